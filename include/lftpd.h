@@ -1,26 +1,161 @@
 #pragma once
 
-typedef struct {
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "lftpd_vfs.h"
+
+struct lftpd;
+struct lftpd_cache;
+struct lftpd_inet_line_buffer;
+struct lftpd_tls;
+struct lftpd_tls_context;
+struct lftpd_trace;
+struct lftpd_trace_buffer;
+
+typedef struct lftpd_client {
+	struct lftpd* lftpd;
 	char* directory;
 	int socket;
 	int data_socket;
+	// the PASV or EPSV listener while waiting for the data connection
+	int pasv_socket;
+	// whether the session holds one of the server's max_transfers slots,
+	// from PASV or EPSV until the transfer ends
+	bool transfer_slot;
+	struct in6_addr address;
+	size_t memory_used;
+	// set once the client has secured the control connection with
+	// AUTH TLS, and for the current data connection if it asked for
+	// PROT P
+	struct lftpd_tls* control_tls;
+	struct lftpd_tls* data_tls;
+	bool protect_data;
+	// progress of the current transfer, for STAT, and what the client
+	// asked for while it ran
+	bool transferring;
+	bool abort_requested;
+	bool quit_requested;
+	unsigned long long transfer_bytes;
+	struct timespec transfer_start;
+	// the pieces the current transfer was moved in, one per sendfile(),
+	// read or buffer written, and the polls waiting on the data
+	// connection, for the /.bench report
+	unsigned long transfer_chunks;
+	unsigned long transfer_polls;
+	// control connection input read past the current command
+	struct lftpd_inet_line_buffer* control_input;
+	// a command received during a transfer, run once it ends
+	char* deferred_command;
+	// set by SITE EXTRACT ON, so STOR somedir.tar unpacks into somedir
+	bool extract_archives;
+	// the path named by RNFR, waiting for RNTO
+	char* rename_from;
+	// MODE B frames transfers in blocks and keeps the data connection
+	// open between them. While receiving, what is left of the current
+	// block, whether it is the last and whether it is a restart marker.
+	bool block_mode;
+	size_t block_remaining;
+	bool block_eof;
+	bool block_restart;
+	// where the session records spans when tracing is on, and how long
+	// the current transfer has spent waiting on the data connection
+	struct lftpd_trace_buffer* trace;
+	unsigned long long transfer_wait_ns;
+
+	struct lftpd_client* next;
 } lftpd_client_t;
 
+/**
+ * @brief Resource limits for a server. A value of 0 selects the
+ * default and a negative value removes the limit. Timeouts are in
+ * seconds and the memory budget is in bytes.
+ */
+typedef struct {
+	int max_sessions;
+	int max_sessions_per_ip;
+	int max_transfers;
+	int listen_backlog;
+	int control_idle_timeout;
+	int data_idle_timeout;
+	long session_memory;
+} lftpd_limits_t;
+
 typedef struct {
+	unsigned long sessions_accepted;
+	unsigned long sessions_rejected;
+	unsigned long transfers_rejected;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+} lftpd_stats_t;
+
+typedef struct lftpd {
 	const char* directory;
 	int port;
-	int server_socket;
+	lftpd_limits_t limits;
+	lftpd_vfs_t* vfs;
+	// bytes of small file content to keep in memory, 0 to disable
+	size_t cache_capacity;
+	// largest file the cache will hold, 0 for the default
+	size_t cache_max_file_size;
+	// threads used to checksum blocks for SITE CHECKSUMS, 0 for one
+	// per CPU. At most 8 are used, and fewer when their buffers don't
+	// fit in the session's memory budget.
+	int checksum_threads;
+	// PEM certificate chain and private key files. When both are set
+	// clients may secure their sessions with AUTH TLS. Requires lftpd
+	// to be built with TLS=1.
+	const char* tls_certificate;
+	const char* tls_key;
+	// spans to keep per session for SITE TRACE and lftpd_dump_trace(),
+	// 0 to disable tracing
+	size_t trace_events;
 
-	lftpd_client_t* client;
+	int server_socket;
+	// set by lftpd_stop(), so the accept loop can tell a shutdown from
+	// a transient accept() failure
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t sessions_done;
+	lftpd_client_t* clients;
+	int session_count;
+	int transfer_count;
+	lftpd_stats_t stats;
+	struct lftpd_cache* cache;
+	struct lftpd_tls_context* tls;
+	struct lftpd_trace* trace;
 } lftpd_t;
 
 /**
  * @brief Create a server on port and start listening for client
  * connections. This function blocks for the life of the server and
  * only returns when lftpd_stop() is called with the same lftpd_t.
+ * Each client session runs on its own thread.
+ *
+ * The lftpd_t should be zero initialized before the call. Any limits
+ * set in lftpd->limits are honored, and unset limits take their
+ * defaults. If lftpd->vfs is set all file access goes through it,
+ * otherwise the local file system is used.
  */
 int lftpd_start(const char* directory, int port, lftpd_t* lftpd);
 
+/**
+ * @brief Copy the server's counters into stats. Safe to call from any
+ * thread while the server is running.
+ */
+void lftpd_get_stats(lftpd_t* lftpd, lftpd_stats_t* stats);
+
+/**
+ * @brief Write the spans recorded by the server's sessions to file as
+ * Chrome trace event JSON. Safe to call from any thread while the
+ * server is running. Returns -1 if tracing is disabled.
+ */
+int lftpd_dump_trace(lftpd_t* lftpd, FILE* file);
+
 /**
  * @brief Stop a previously started server. This kills any active client
  * connections, shuts down the listener, and returns. After this
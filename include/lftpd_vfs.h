@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+typedef enum {
+	LFTPD_VFS_READ,
+	// create the file if needed and truncate it
+	LFTPD_VFS_WRITE,
+} lftpd_vfs_mode_t;
+
+/**
+ * @brief A table of file system operations. lftpd performs all file
+ * access through one of these, so a server can be backed by something
+ * other than the local file system. Paths are always absolute and
+ * canonical. Functions returning int return 0 on success and -1 on
+ * failure. The file and directory handles are opaque to lftpd.
+ *
+ * Every session thread shares the same table, so implementations must
+ * be thread safe.
+ */
+typedef struct lftpd_vfs {
+	void* context;
+
+	void* (*open)(struct lftpd_vfs* vfs, const char* path, lftpd_vfs_mode_t mode);
+	ssize_t (*read)(struct lftpd_vfs* vfs, void* file, void* buffer, size_t len);
+	ssize_t (*write)(struct lftpd_vfs* vfs, void* file, const void* buffer, size_t len);
+	/**
+	 * @brief Besides SEEK_SET, SEEK_CUR and SEEK_END, backends that can
+	 * find holes in sparse files should support SEEK_DATA and SEEK_HOLE,
+	 * and others should fail them with EINVAL. Seeking past the end and
+	 * writing must leave a gap that reads back as zeros.
+	 */
+	off_t (*seek)(struct lftpd_vfs* vfs, void* file, off_t offset, int whence);
+	int (*close)(struct lftpd_vfs* vfs, void* file);
+	int (*stat)(struct lftpd_vfs* vfs, const char* path, struct stat* st);
+
+	void* (*opendir)(struct lftpd_vfs* vfs, const char* path);
+	/**
+	 * @brief Return the name of the next entry, or NULL at the end. The
+	 * name remains valid until the next call on the same handle.
+	 */
+	const char* (*readdir)(struct lftpd_vfs* vfs, void* dir);
+	int (*closedir)(struct lftpd_vfs* vfs, void* dir);
+
+	int (*unlink)(struct lftpd_vfs* vfs, const char* path);
+	int (*mkdir)(struct lftpd_vfs* vfs, const char* path);
+	int (*rename)(struct lftpd_vfs* vfs, const char* from, const char* to);
+
+	/**
+	 * @brief Optional. Set the modification time of path. If NULL,
+	 * clients can't set modification times.
+	 */
+	int (*utime)(struct lftpd_vfs* vfs, const char* path, time_t mtime);
+
+	/**
+	 * @brief Optional. Set the permission bits of path. If NULL, a file
+	 * replaced by SITE DELTA gets the mode of a newly created one.
+	 */
+	int (*chmod)(struct lftpd_vfs* vfs, const char* path, mode_t mode);
+
+	/**
+	 * @brief Optional zero copy hook. Write up to count bytes of file,
+	 * starting at *offset, directly to socket and advance *offset.
+	 * Returns the number of bytes sent, 0 at end of file or -1 on error.
+	 * If NULL, or if the first call fails with ENOSYS or EINVAL, lftpd
+	 * falls back to read() and write().
+	 */
+	ssize_t (*sendfile)(struct lftpd_vfs* vfs, void* file, int socket, off_t* offset, size_t count);
+
+	/**
+	 * @brief Optional. Make to, freshly opened for writing, share the
+	 * whole content of from without copying it, as a reflink does. If
+	 * NULL or it fails, the file is copied.
+	 */
+	int (*clone)(struct lftpd_vfs* vfs, void* from, void* to);
+
+	/**
+	 * @brief Optional. Copy up to count bytes from the current position
+	 * of from to the current position of to without passing them
+	 * through lftpd, advancing both. Returns the number of bytes copied,
+	 * 0 at end of file or -1 on error. If NULL, or if the first call
+	 * fails with ENOSYS, EXDEV or EINVAL, lftpd falls back to read() and
+	 * write().
+	 */
+	ssize_t (*copy)(struct lftpd_vfs* vfs, void* from, void* to, size_t count);
+
+	/**
+	 * @brief Optional. Return a non-blocking file descriptor that polls
+	 * readable when the file at path is written, truncated, renamed or
+	 * removed, or -1 on error. lftpd reads and discards whatever it
+	 * becomes readable with and close()s it when done. If NULL, SITE
+	 * FOLLOW is answered with 502.
+	 */
+	int (*watch)(struct lftpd_vfs* vfs, const char* path);
+} lftpd_vfs_t;
+
+/**
+ * @brief Fill vfs with the operations for the local POSIX file system.
+ * This is what lftpd uses when no vfs is given.
+ */
+void lftpd_vfs_posix_init(lftpd_vfs_t* vfs);
+
+/**
+ * @brief Create an empty in-memory file system containing only /.
+ * Files stored by clients live in RAM until they are deleted or the
+ * file system is destroyed.
+ */
+int lftpd_vfs_mem_init(lftpd_vfs_t* vfs);
+
+/**
+ * @brief Free an in-memory file system and everything in it. No
+ * server may be using it.
+ */
+void lftpd_vfs_mem_destroy(lftpd_vfs_t* vfs);
+
+/**
+ * @brief Add a file to an in-memory file system, creating any missing
+ * parent directories. The data is copied.
+ */
+int lftpd_vfs_mem_add_file(lftpd_vfs_t* vfs, const char* path, const void* data, size_t len);
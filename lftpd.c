@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -13,6 +14,15 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fnmatch.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
 
 #include "lftpd.h"
 
@@ -21,6 +31,14 @@
 #include "private/lftpd_log.h"
 #include "private/lftpd_string.h"
 #include "private/lftpd_io.h"
+#include "private/lftpd_cache.h"
+#include "private/lftpd_tar.h"
+#include "private/lftpd_delta.h"
+#include "private/lftpd_md5.h"
+#include "private/lftpd_trace.h"
+#ifdef LFTPD_TLS
+#include "private/lftpd_tls.h"
+#endif
 
 // https://tools.ietf.org/html/rfc959
 // https://tools.ietf.org/html/rfc2389#section-2.2
@@ -28,44 +46,123 @@
 // https://tools.ietf.org/html/rfc5797
 // https://tools.ietf.org/html/rfc2428#section-3 EPSV
 // https://en.wikipedia.org/wiki/List_of_FTP_commands
+// https://tools.ietf.org/html/draft-somers-ftp-mfxx-04 MFMT
+// https://tools.ietf.org/html/rfc4217 FTPS
+// https://tools.ietf.org/html/rfc854 Telnet, for the IP and Synch sent
+// ahead of ABOR
+
+#define DEFAULT_MAX_SESSIONS 8
+#define DEFAULT_MAX_SESSIONS_PER_IP 4
+#define DEFAULT_MAX_TRANSFERS 4
+#define DEFAULT_LISTEN_BACKLOG 10
+#define DEFAULT_CONTROL_IDLE_TIMEOUT 300
+#define DEFAULT_DATA_IDLE_TIMEOUT 60
+#define DEFAULT_SESSION_MEMORY (64 * 1024)
+// how long to back off when accept() fails for lack of descriptors
+#define ACCEPT_RETRY_DELAY_NS (100 * 1000 * 1000)
+
+#define CONTROL_BUFFER_SIZE 512
+#define TRANSFER_BUFFER_SIZE 8192
+#define SENDFILE_CHUNK_SIZE (256 * 1024)
+// uploads are checked for zeros, and left sparse, a block at a time
+#define SPARSE_BLOCK_SIZE 4096
+// SITE COPY checks for ABOR and STAT between pieces this big
+#define COPY_CHUNK_SIZE (1024 * 1024)
+#define DEFAULT_CACHE_MAX_FILE_SIZE (64 * 1024)
+#define TAR_MAX_DEPTH 32
+#define LIST_MAX_DEPTH 32
+#define MIN_CHECKSUM_BLOCK_SIZE 512
+#define MAX_CHECKSUM_BLOCK_SIZE (16 * 1024 * 1024)
+#define MAX_CHECKSUM_THREADS 8
+#define CHECKSUM_BATCH_BLOCKS 256
+#define DELTA_TEMP_SUFFIX ".lftpd-delta"
+// LIST shows the time of day rather than the year for files modified
+// within about six months, like ls
+#define LIST_RECENT_SECONDS (182 * 24 * 60 * 60)
+
+// glibc only declares these with _GNU_SOURCE
+#if defined(__linux__) && !defined(SEEK_DATA)
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+// MODE B block header descriptor bits, RFC 959 section 3.4.2
+#define BLOCK_EOF 0x40
+#define BLOCK_RESTART 0x10
+
+#define TELNET_IAC 255
+#define TELNET_WILL 251
+#define TELNET_DONT 254
+
+// with tracing off each trace point costs a single, well predicted
+// branch
+#define TRACE_START(client) ((client)->trace ? lftpd_trace_now() : 0)
+#define TRACE_SPAN(client, name, arg, start) \
+	do { \
+		if ((client)->trace) { \
+			lftpd_trace_span((client)->trace, name, arg, start); \
+		} \
+	} while (0)
 
 typedef struct {
 	char *command;
 	int (*handler) (lftpd_client_t* client, const char* arg);
 } command_t;
 
+static int cmd_abor();
+static int cmd_auth();
 static int cmd_cwd();
 static int cmd_dele();
 static int cmd_epsv();
 static int cmd_feat();
 static int cmd_list();
+static int cmd_mdtm();
+static int cmd_mfmt();
+static int cmd_mode();
 static int cmd_nlst();
 static int cmd_noop();
 static int cmd_pass();
 static int cmd_pasv();
+static int cmd_pbsz();
+static int cmd_prot();
 static int cmd_pwd();
 static int cmd_quit();
 static int cmd_retr();
+static int cmd_rnfr();
+static int cmd_rnto();
+static int cmd_site();
 static int cmd_size();
+static int cmd_stat();
 static int cmd_stor();
 static int cmd_syst();
 static int cmd_type();
 static int cmd_user();
 
 static command_t commands[] = {
+	{ "ABOR", cmd_abor },
+	{ "AUTH", cmd_auth },
 	{ "CWD", cmd_cwd },
 	{ "DELE", cmd_dele },
 	{ "EPSV", cmd_epsv },
 	{ "FEAT", cmd_feat },
 	{ "LIST", cmd_list },
+	{ "MDTM", cmd_mdtm },
+	{ "MFMT", cmd_mfmt },
+	{ "MODE", cmd_mode },
 	{ "NLST", cmd_nlst },
 	{ "NOOP", cmd_noop },
 	{ "PASS", cmd_pass },
 	{ "PASV", cmd_pasv },
+	{ "PBSZ", cmd_pbsz },
+	{ "PROT", cmd_prot },
 	{ "PWD", cmd_pwd },
 	{ "QUIT", cmd_quit },
 	{ "RETR", cmd_retr },
+	{ "RNFR", cmd_rnfr },
+	{ "RNTO", cmd_rnto },
+	{ "SITE", cmd_site },
 	{ "SIZE", cmd_size },
+	{ "STAT", cmd_stat },
 	{ "STOR", cmd_stor },
 	{ "SYST", cmd_syst },
 	{ "TYPE", cmd_type },
@@ -73,6 +170,147 @@ static command_t commands[] = {
 	{ NULL, NULL },
 };
 
+static int site_checksums();
+static int site_copy();
+static int site_delta();
+static int site_extract();
+static int site_follow();
+static int site_stats();
+static int site_trace();
+
+static command_t site_commands[] = {
+	{ "CHECKSUMS", site_checksums },
+	{ "COPY", site_copy },
+	{ "DELTA", site_delta },
+	{ "EXTRACT", site_extract },
+	{ "FOLLOW", site_follow },
+	{ "STATS", site_stats },
+	{ "TRACE", site_trace },
+	{ NULL, NULL },
+};
+
+#ifdef LFTPD_TLS
+// the session served by this thread, so the socket helpers below can
+// find the TLS state for a socket without every caller passing it along
+static __thread lftpd_client_t* thread_client;
+
+static lftpd_tls_t* socket_tls(int socket) {
+	lftpd_client_t* client = thread_client;
+	if (client == NULL || socket < 0) {
+		return NULL;
+	}
+	if (socket == client->socket) {
+		return client->control_tls;
+	}
+	if (socket == client->data_socket) {
+		return client->data_tls;
+	}
+	return NULL;
+}
+#endif
+
+/**
+ * @brief Write all of buffer to a control or data socket, through TLS
+ * if the client has secured it.
+ */
+static int socket_write(int socket, const void* buffer, size_t len) {
+#ifdef LFTPD_TLS
+	lftpd_tls_t* tls = socket_tls(socket);
+	if (tls) {
+		return lftpd_tls_write(tls, buffer, len);
+	}
+#endif
+	return lftpd_inet_write(socket, buffer, len);
+}
+
+/**
+ * @brief Write buffer to a data socket as one MODE B block, len being
+ * at most TRANSFER_BUFFER_SIZE.
+ */
+static int socket_write_block(int socket, unsigned char descriptor, const void* buffer, size_t len) {
+	unsigned char header[3] = { descriptor, (unsigned char) (len >> 8), (unsigned char) len };
+#ifdef LFTPD_TLS
+	lftpd_tls_t* tls = socket_tls(socket);
+	if (tls) {
+		// one write, so the header doesn't go in a TLS record of its own
+		unsigned char record[sizeof(header) + TRANSFER_BUFFER_SIZE];
+		if (len > TRANSFER_BUFFER_SIZE) {
+			return -1;
+		}
+		memcpy(record, header, sizeof(header));
+		if (len > 0) {
+			memcpy(record + sizeof(header), buffer, len);
+		}
+		return lftpd_tls_write(tls, record, sizeof(header) + len);
+	}
+#endif
+	// header and data in a single write
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof(header) },
+		{ .iov_base = (void*) buffer, .iov_len = len },
+	};
+	return lftpd_inet_writev(socket, iov, len > 0 ? 2 : 1);
+}
+
+static ssize_t socket_read(int socket, void* buffer, size_t len) {
+#ifdef LFTPD_TLS
+	lftpd_tls_t* tls = socket_tls(socket);
+	if (tls) {
+		return lftpd_tls_read(tls, buffer, len);
+	}
+#endif
+	return read(socket, buffer, len);
+}
+
+/**
+ * @brief Read the next line from the control connection into buffer.
+ * Unless wait is set, only input that has already arrived is read, and
+ * 1 is returned while the line is incomplete.
+ */
+static int socket_read_line(int socket, lftpd_inet_line_buffer_t* input, char* buffer, size_t buffer_len, bool wait) {
+#ifdef LFTPD_TLS
+	lftpd_tls_t* tls = socket_tls(socket);
+	if (tls) {
+		// the TLS layer hands over whole records, which are split into
+		// lines the same way
+		int err;
+		if (!wait) {
+			lftpd_inet_set_nonblocking(socket, true);
+		}
+		while ((err = lftpd_inet_take_line(input, buffer, buffer_len)) == 1) {
+			ssize_t read_len = lftpd_tls_read(tls, input->data + input->len, sizeof(input->data) - input->len);
+			if (read_len < 0 && !wait && errno == EAGAIN) {
+				break;
+			}
+			if (read_len <= 0) {
+				err = -1;
+				break;
+			}
+			input->len += read_len;
+		}
+		if (!wait) {
+			lftpd_inet_set_nonblocking(socket, false);
+		}
+		return err;
+	}
+#endif
+	return lftpd_inet_read_line(socket, input, buffer, buffer_len, wait ? 0 : MSG_DONTWAIT);
+}
+
+/**
+ * @brief True if file data may be sent to the socket with the vfs
+ * sendfile hook, which bypasses any userspace TLS.
+ */
+static bool socket_zero_copy(int socket) {
+#ifdef LFTPD_TLS
+	lftpd_tls_t* tls = socket_tls(socket);
+	if (tls) {
+		return lftpd_tls_kernel_send(tls);
+	}
+#endif
+	return true;
+}
+
 static int send_response(int socket, int code, bool include_code,
 		bool multiline_start, const char* format, ...) {
 	va_list args;
@@ -101,7 +339,10 @@ static int send_response(int socket, int code, bool include_code,
 		return -1;
 	}
 
-	err = lftpd_inet_write_string(socket, response);
+	err = socket_write(socket, response, strlen(response));
+	if (err == 0) {
+		lftpd_log_debug("> %s", response);
+	}
 	free(response);
 	return err;
 }
@@ -114,336 +355,3035 @@ static int send_response(int socket, int code, bool include_code,
 
 #define send_multiline_response_end(socket, code, format, ...) send_response(socket, code, true, false, format, ##__VA_ARGS__)
 
-static int send_list(int socket, const char* path) {
-	// https://files.stairways.com/other/ftp-list-specs-info.txt
-	// http://cr.yp.to/ftp/list/binls.html
-	static const char* directory_format = "drw-rw-rw- 1 owner group %13llu Jan 01  1970 %s";
-	static const char* file_format = "-rw-rw-rw- 1 owner group %13llu Jan 01  1970 %s";
+static void* session_alloc(lftpd_client_t* client, size_t size) {
+	long budget = client->lftpd->limits.session_memory;
+	if (budget > 0 && client->memory_used + size > (size_t) budget) {
+		lftpd_log_error("session memory budget exceeded");
+		return NULL;
+	}
+	void* p = malloc(size);
+	if (p != NULL) {
+		client->memory_used += size;
+	}
+	return p;
+}
 
-	DIR* dp = opendir(path);
-	if (dp == NULL) {
-		return -1;
+/**
+ * @brief Bytes the session may still allocate, SIZE_MAX without a
+ * budget.
+ */
+static size_t session_available(lftpd_client_t* client) {
+	long budget = client->lftpd->limits.session_memory;
+	if (budget <= 0) {
+		return SIZE_MAX;
 	}
+	return client->memory_used < (size_t) budget ? (size_t) budget - client->memory_used : 0;
+}
 
-	struct dirent *entry;
-	while ((entry = readdir(dp))) {
-		char* file_path = lftpd_io_canonicalize_path(path, entry->d_name);
-		struct stat st;
-		if (stat(file_path, &st) == 0) {
-			unsigned long long size = st.st_size;
-			if (S_ISDIR(st.st_mode)) {
-				send_multiline_response_line(socket, directory_format, size, entry->d_name);
-			}
-			else if (S_ISREG(st.st_mode)) {
-				send_multiline_response_line(socket, file_format, size, entry->d_name);
-			}
-		}
-		free(file_path);
+static void session_free(lftpd_client_t* client, void* p, size_t size) {
+	if (p == NULL) {
+		return;
 	}
+	free(p);
+	client->memory_used -= size;
+}
 
-	closedir(dp);
+static bool acquire_transfer(lftpd_t* lftpd) {
+	bool acquired = false;
+	pthread_mutex_lock(&lftpd->lock);
+	if (lftpd->limits.max_transfers < 0 || lftpd->transfer_count < lftpd->limits.max_transfers) {
+		lftpd->transfer_count++;
+		acquired = true;
+	}
+	else {
+		lftpd->stats.transfers_rejected++;
+	}
+	pthread_mutex_unlock(&lftpd->lock);
+	return acquired;
+}
 
-	return 0;
+static void release_transfer(lftpd_t* lftpd) {
+	pthread_mutex_lock(&lftpd->lock);
+	lftpd->transfer_count--;
+	pthread_mutex_unlock(&lftpd->lock);
 }
 
-static int send_nlst(int socket, const char* path) {
-	DIR* dp = opendir(path);
-	if (dp == NULL) {
-		return -1;
+/**
+ * @brief Take a transfer slot for the session, unless it already holds
+ * one.
+ */
+static bool acquire_session_transfer(lftpd_client_t* client) {
+	if (client->transfer_slot) {
+		return true;
 	}
+	client->transfer_slot = acquire_transfer(client->lftpd);
+	return client->transfer_slot;
+}
 
-	struct dirent *entry;
-	while ((entry = readdir(dp))) {
-		char* file_path = lftpd_io_canonicalize_path(path, entry->d_name);
-		struct stat st;
-		if (stat(file_path, &st) == 0) {
-			if (S_ISREG(st.st_mode)) {
-				send_multiline_response_line(socket, entry->d_name);
-			}
-		}
-		free(file_path);
+static void release_session_transfer(lftpd_client_t* client) {
+	if (client->transfer_slot) {
+		release_transfer(client->lftpd);
+		client->transfer_slot = false;
 	}
+}
 
-	closedir(dp);
-
-	return 0;
+/**
+ * @brief Close one of the session's sockets and mark it closed. This is
+ * done under the server lock so that lftpd_stop() never shuts down a
+ * descriptor that has since been reused.
+ */
+static void close_session_socket(lftpd_client_t* client, int* socket) {
+	pthread_mutex_lock(&client->lftpd->lock);
+	close(*socket);
+	*socket = -1;
+	pthread_mutex_unlock(&client->lftpd->lock);
 }
 
-static int send_file(int socket, const char* path) {
-	FILE* file = fopen(path, "rb");
-	if (file == NULL) {
-		lftpd_log_error("failed to open file for read");
-		return -1;
+static void close_data_connection(lftpd_client_t* client) {
+	if (client->data_socket == -1) {
+		return;
 	}
-	unsigned char buffer[1024];
-	int read_len;
-	while ((read_len = fread(buffer, 1, 1024, file)) > 0) {
-		unsigned char* p = buffer;
-		while (read_len) {
-			int write_len = write(socket, p, read_len);
-			if (write_len < 0) {
-				lftpd_log_error("write error");
-				fclose(file);
-				return -1;
-			}
-			p += write_len;
-			read_len -= write_len;
+	uint64_t start = TRACE_START(client);
+#ifdef LFTPD_TLS
+	lftpd_tls_close(client->data_tls);
+	client->data_tls = NULL;
+#endif
+	close_session_socket(client, &client->data_socket);
+	release_session_transfer(client);
+	TRACE_SPAN(client, "close", NULL, start);
+}
+
+/**
+ * @brief Done with the data connection for this transfer. In stream
+ * mode closing it is what marks the end of the data. In block mode a
+ * transfer that went through ends with an EOF block, sent or received,
+ * and the connection is kept for the next one, without its transfer
+ * slot, so an idle session doesn't hold one. Otherwise it is closed,
+ * which tells the client the data is incomplete.
+ */
+static void finish_data_connection(lftpd_client_t* client, bool received, int err) {
+	if (client->block_mode && err == 0 && !client->abort_requested && client->data_socket != -1) {
+		if (received ? client->block_eof : socket_write_block(client->data_socket, BLOCK_EOF, NULL, 0) == 0) {
+			release_session_transfer(client);
+			return;
 		}
 	}
+	close_data_connection(client);
+}
 
-	fclose(file);
+/**
+ * @brief Reply to a transfer that went through: 226 if the data
+ * connection was closed, 250 if block mode kept it open.
+ */
+static void send_transfer_complete(lftpd_client_t* client) {
+	if (client->data_socket == -1) {
+		send_simple_response(client->socket, 226, STATUS_226);
+	}
+	else {
+		send_simple_response(client->socket, 250, STATUS_250);
+	}
+}
 
-	return 0;
+static uint64_t timespec_ns(const struct timespec* ts) {
+	return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
 }
 
-static int receive_file(int socket, const char* path) {
-	FILE* file = fopen(path, "wb");
-	if (file == NULL) {
-		lftpd_log_error("failed to open file for write");
+/**
+ * @brief Tell the client the transfer is starting and, if it asked for
+ * a protected data channel, run the TLS handshake, which the client
+ * begins once it sees the 150 reply. On failure the data connection is
+ * closed and the client told.
+ */
+static void reset_transfer(lftpd_client_t* client) {
+	client->transferring = true;
+	client->abort_requested = false;
+	client->transfer_bytes = 0;
+	client->transfer_chunks = 0;
+	client->transfer_polls = 0;
+	client->transfer_wait_ns = 0;
+	client->block_remaining = 0;
+	client->block_eof = false;
+	client->block_restart = false;
+	clock_gettime(CLOCK_MONOTONIC, &client->transfer_start);
+}
+
+static int start_transfer(lftpd_client_t* client) {
+	// a data connection kept open in block mode gave up its slot
+	// between transfers
+	if (!acquire_session_transfer(client)) {
+		send_simple_response(client->socket, 425, STATUS_425);
 		return -1;
 	}
-
-	unsigned char buffer[1024];
-	int err;
-	while ((err = read(socket, buffer, 1024)) > 0) {
-		if (fwrite(buffer, err, 1, file) != 1) {
-			err = -1;
-			break;
+	reset_transfer(client);
+	send_simple_response(client->socket, 150, STATUS_150);
+#ifdef LFTPD_TLS
+	// a data connection kept open in block mode is already secured
+	if (client->protect_data && client->data_tls == NULL) {
+		uint64_t start = TRACE_START(client);
+		client->data_tls = lftpd_tls_accept(client->lftpd->tls, client->data_socket);
+		TRACE_SPAN(client, "handshake", NULL, start);
+		if (client->data_tls == NULL) {
+			lftpd_log_error("error securing data connection");
+			close_data_connection(client);
+			client->transferring = false;
+			send_simple_response(client->socket, 425, STATUS_425);
+			return -1;
 		}
 	}
+#endif
+	return 0;
+}
 
-	fclose(file);
-
-	if (err < 0) {
-		return err;
+/**
+ * @brief Mark the transfer finished. If the client aborted it, send
+ * the 426 for the transfer and the reply to the ABOR or QUIT, and
+ * return true so the caller sends nothing more.
+ */
+static bool end_transfer(lftpd_client_t* client) {
+	client->transferring = false;
+	if (client->trace) {
+		// the rest of the transfer went to storage and to copying
+		char arg[LFTPD_TRACE_ARG_MAX];
+		snprintf(arg, sizeof(arg), "%llu bytes, %llu ms waiting on network",
+				client->transfer_bytes, client->transfer_wait_ns / 1000000);
+		lftpd_trace_span(client->trace, "transfer", arg, timespec_ns(&client->transfer_start));
 	}
-
-	return 0;
+	if (!client->abort_requested) {
+		return false;
+	}
+	client->abort_requested = false;
+	lftpd_log_info("transfer aborted after %llu bytes", client->transfer_bytes);
+	send_simple_response(client->socket, 426, STATUS_426);
+	if (client->quit_requested) {
+		send_simple_response(client->socket, 221, STATUS_221);
+	}
+	else {
+		send_simple_response(client->socket, 226, STATUS_226);
+	}
+	return true;
 }
 
-static int cmd_cwd(lftpd_client_t* client, const char* arg) {
-	if (arg == NULL || strlen(arg) == 0) {
-		send_simple_response(client->socket, 550, STATUS_550);
+/**
+ * @brief Remove Telnet commands from a control line in place. RFC 959
+ * clients send IAC IP and the IAC DM Synch ahead of ABOR.
+ */
+static void strip_telnet(char* line) {
+	unsigned char* in = (unsigned char*) line;
+	unsigned char* out = in;
+	while (*in) {
+		if (*in != TELNET_IAC) {
+			*out++ = *in++;
+			continue;
+		}
+		in++;
+		if (*in == TELNET_IAC) {
+			// an escaped data byte
+			*out++ = *in++;
+		}
+		else if (*in >= TELNET_WILL && *in <= TELNET_DONT) {
+			// option negotiation carries an option byte
+			in++;
+			if (*in) {
+				in++;
+			}
+		}
+		else if (*in) {
+			in++;
+		}
 	}
+	*out = '\0';
+}
 
-	char* path = lftpd_io_canonicalize_path(client->directory, arg);
+static double transfer_seconds(lftpd_client_t* client) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - client->transfer_start.tv_sec)
+			+ (now.tv_nsec - client->transfer_start.tv_nsec) / 1e9;
+}
 
-	// make sure the path exists
-	struct stat st;
-	if (stat(path, &st) != 0) {
-		send_simple_response(client->socket, 550, STATUS_550);
-		free(path);
+static void send_transfer_status(lftpd_client_t* client) {
+	double seconds = transfer_seconds(client);
+	double rate = seconds > 0 ? client->transfer_bytes / seconds : 0;
+	send_simple_response(client->socket, 213, "Transferred %llu bytes in %.1f seconds, %.0f bytes/second.",
+			client->transfer_bytes, seconds, rate);
+}
+
+/**
+ * @brief Handle a command that arrives while a transfer is running.
+ * ABOR and QUIT stop the transfer and STAT reports its progress.
+ * Anything else is held and run once the transfer ends. Returns -1 if
+ * the transfer should stop.
+ */
+static int service_control(lftpd_client_t* client) {
+	char line[CONTROL_BUFFER_SIZE];
+	// a partial line is kept until the rest arrives, rather than
+	// holding up the transfer waiting for it
+	int err = socket_read_line(client->socket, client->control_input, line, sizeof(line), false);
+	if (err == 1) {
+		return 0;
+	}
+	if (err != 0) {
+		// with the control connection gone nobody wants the data
+		lftpd_log_error("control connection lost during transfer");
+		client->abort_requested = true;
+		client->quit_requested = true;
 		return -1;
 	}
-
-	// make sure the path is a directory
-	if (!S_ISDIR(st.st_mode)) {
-		send_simple_response(client->socket, 550, STATUS_550);
-		free(path);
+	strip_telnet(line);
+	size_t len = strcspn(line, " ");
+	if (len == 0) {
+		return 0;
+	}
+	if (len == 4 && strncasecmp(line, "ABOR", 4) == 0) {
+		client->abort_requested = true;
 		return -1;
 	}
-
-	free(client->directory);
-	client->directory = path;
-	send_simple_response(client->socket, 250, STATUS_250);
-
+	if (len == 4 && strncasecmp(line, "QUIT", 4) == 0) {
+		client->abort_requested = true;
+		client->quit_requested = true;
+		return -1;
+	}
+	if (len == 4 && strncasecmp(line, "STAT", 4) == 0) {
+		send_transfer_status(client);
+		return 0;
+	}
+	if (len == 4 && strncasecmp(line, "NOOP", 4) == 0) {
+		send_simple_response(client->socket, 200, STATUS_200);
+		return 0;
+	}
+	client->deferred_command = session_alloc(client, CONTROL_BUFFER_SIZE);
+	if (client->deferred_command == NULL) {
+		send_simple_response(client->socket, 503, STATUS_503);
+		return 0;
+	}
+	memcpy(client->deferred_command, line, CONTROL_BUFFER_SIZE);
 	return 0;
 }
 
-static int cmd_dele(lftpd_client_t* client, const char* arg) {
-	if (arg == NULL || strlen(arg) == 0) {
-		send_simple_response(client->socket, 550, STATUS_550);
+/**
+ * @brief True if control input has already been read, or decrypted, so
+ * that polling the socket won't show it. Once a command is held the
+ * rest wait behind it.
+ */
+static bool control_input_pending(lftpd_client_t* client) {
+	if (client->deferred_command) {
+		return false;
 	}
+	if (client->control_input && lftpd_inet_has_line(client->control_input)) {
+		return true;
+	}
+#ifdef LFTPD_TLS
+	return client->control_tls && lftpd_tls_pending(client->control_tls) > 0;
+#else
+	return false;
+#endif
+}
 
-	char* path = lftpd_io_canonicalize_path(client->directory, arg);
+/**
+ * @brief Wait until the data connection is ready for events, servicing
+ * the control connection meanwhile. Returns 0 when it is ready, or -1
+ * if the transfer was aborted or the data connection went idle.
+ */
+static int wait_for_data(lftpd_client_t* client, short events) {
+	while (!client->abort_requested) {
+#ifdef LFTPD_TLS
+		// TLS may hold decrypted data that polling the socket won't show
+		if (events == POLLIN && client->data_tls && lftpd_tls_pending(client->data_tls) > 0) {
+			return 0;
+		}
+#endif
+		bool control_pending = control_input_pending(client);
+		// once a command is held stop reading the control connection,
+		// so that later commands stay queued behind it
+		struct pollfd fds[2] = {
+			{ .fd = client->data_socket, .events = events },
+			{ .fd = client->socket, .events = POLLIN | POLLPRI },
+		};
+		nfds_t nfds = client->deferred_command ? 1 : 2;
+		int timeout = client->lftpd->limits.data_idle_timeout;
+		uint64_t start = TRACE_START(client);
+		client->transfer_polls++;
+		int ready = poll(fds, nfds, control_pending ? 0 : timeout > 0 ? timeout * 1000 : -1);
+		if (client->trace) {
+			client->transfer_wait_ns += lftpd_trace_now() - start;
+		}
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (ready == 0 && !control_pending) {
+			lftpd_log_error("data connection idle");
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (nfds == 2 && (control_pending || fds[1].revents)) {
+			if (service_control(client) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		// errors and hang ups are reported by the read or write
+		return 0;
+	}
+	return -1;
+}
 
-	// make sure the path exists
-	struct stat st;
-	if (stat(path, &st) != 0) {
-		send_simple_response(client->socket, 550, STATUS_550);
-		free(path);
-		return -1;
+static void transfer_progress(lftpd_client_t* client, size_t len) {
+	if (client->transfer_bytes == 0) {
+		TRACE_SPAN(client, "first byte", NULL, timespec_ns(&client->transfer_start));
 	}
+	client->transfer_bytes += len;
+	client->transfer_chunks++;
+}
 
-	// make sure the path is a file
-	if (!S_ISREG(st.st_mode)) {
-		send_simple_response(client->socket, 550, STATUS_550);
-		free(path);
+/**
+ * @brief Service the control connection, without blocking, during work
+ * that has no data connection to wait on. Returns -1 if the work should
+ * stop.
+ */
+static int poll_control(lftpd_client_t* client) {
+	if (client->abort_requested) {
 		return -1;
 	}
+	if (client->deferred_command) {
+		return 0;
+	}
+	struct pollfd fd = { .fd = client->socket, .events = POLLIN | POLLPRI };
+	if (!control_input_pending(client) && poll(&fd, 1, 0) <= 0) {
+		return 0;
+	}
+	return service_control(client);
+}
 
-	remove(path);
-	free(path);
-	send_simple_response(client->socket, 250, STATUS_250);
-
+/**
+ * @brief Write all of buffer to the data connection, in pieces so that
+ * an abort is noticed between them. In block mode each piece is a
+ * block.
+ */
+static int data_write(lftpd_client_t* client, const void* buffer, size_t len) {
+	const unsigned char* p = buffer;
+	while (len > 0) {
+		size_t n = len < TRANSFER_BUFFER_SIZE ? len : TRANSFER_BUFFER_SIZE;
+		if (wait_for_data(client, POLLOUT) != 0) {
+			return -1;
+		}
+		int err = client->block_mode
+				? socket_write_block(client->data_socket, 0, p, n)
+				: socket_write(client->data_socket, p, n);
+		if (err != 0) {
+			return -1;
+		}
+		transfer_progress(client, n);
+		p += n;
+		len -= n;
+	}
 	return 0;
 }
 
-static int cmd_epsv(lftpd_client_t* client, const char* arg) {
-	// open a data port
-	int listener_socket = lftpd_inet_listen(0);
-	if (listener_socket < 0) {
-		send_simple_response(client->socket, 425, STATUS_425);
+static ssize_t data_read_some(lftpd_client_t* client, void* buffer, size_t len) {
+	if (wait_for_data(client, POLLIN) != 0) {
 		return -1;
 	}
+	return socket_read(client->data_socket, buffer, len);
+}
 
-	// get the port from the new socket, which is random
-	int port = lftpd_inet_get_socket_port(listener_socket);
+/**
+ * @brief Read the content of MODE B blocks into buffer, consuming their
+ * headers and skipping restart markers. Returns 0 once the block
+ * marked EOF is done, and -1 if the connection ends before it.
+ */
+static ssize_t data_read_block(lftpd_client_t* client, void* buffer, size_t len) {
+	while (client->block_remaining == 0 || client->block_restart) {
+		if (client->block_remaining == 0) {
+			if (client->block_eof) {
+				return 0;
+			}
+			unsigned char header[3];
+			for (size_t got = 0; got < sizeof(header); ) {
+				ssize_t read_len = data_read_some(client, header + got, sizeof(header) - got);
+				if (read_len <= 0) {
+					lftpd_log_error("data connection closed without an EOF block");
+					return -1;
+				}
+				got += read_len;
+			}
+			client->block_remaining = (header[1] << 8) | header[2];
+			client->block_eof = header[0] & BLOCK_EOF;
+			client->block_restart = header[0] & BLOCK_RESTART;
+			continue;
+		}
+		// a restart marker isn't file data, and with no REST there is
+		// nothing to do with it
+		size_t count = len < client->block_remaining ? len : client->block_remaining;
+		ssize_t read_len = data_read_some(client, buffer, count);
+		if (read_len <= 0) {
+			return -1;
+		}
+		client->block_remaining -= read_len;
+		client->block_restart = client->block_remaining > 0;
+	}
 
-	// format the response
-	send_simple_response(client->socket, 229, STATUS_229, port);
+	size_t count = len < client->block_remaining ? len : client->block_remaining;
+	ssize_t read_len = data_read_some(client, buffer, count);
+	if (read_len <= 0) {
+		lftpd_log_error("data connection closed inside a block");
+		return -1;
+	}
+	client->block_remaining -= read_len;
+	transfer_progress(client, read_len);
+	return read_len;
+}
+
+static ssize_t data_read(lftpd_client_t* client, void* buffer, size_t len) {
+	if (client->block_mode) {
+		return data_read_block(client, buffer, len);
+	}
+	ssize_t read_len = data_read_some(client, buffer, len);
+	if (read_len > 0) {
+		transfer_progress(client, read_len);
+	}
+	return read_len;
+}
 
-	// wait for the connection to the data port
+static int accept_data_connection(lftpd_client_t* client, int listener_socket, int port) {
+	// publish the listener so that lftpd_stop() can wake the accept, and
+	// don't start waiting if the server is already stopping
+	lftpd_t* lftpd = client->lftpd;
+	pthread_mutex_lock(&lftpd->lock);
+	client->pasv_socket = listener_socket;
+	bool stopping = __atomic_load_n(&lftpd->stopping, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&lftpd->lock);
+
+	// wait for the connection to the data port, but don't let a client
+	// that never connects hold the session and the transfer slot forever
 	lftpd_log_debug("waiting for data port connection on port %d...", port);
-	int client_socket = accept(listener_socket, NULL, NULL);
+	uint64_t start = TRACE_START(client);
+	int client_socket = stopping ? -1 : lftpd_inet_accept(listener_socket, lftpd->limits.data_idle_timeout);
+	TRACE_SPAN(client, "accept", client_socket < 0 ? "failed" : NULL, start);
 	if (client_socket < 0) {
 		lftpd_log_error("error accepting client socket");
-		close(listener_socket);
+		close_session_socket(client, &client->pasv_socket);
+		release_session_transfer(client);
 		return -1;
 	}
 	lftpd_log_debug("data port connection received...");
 
-	// close the listener
-	close(listener_socket);
+	lftpd_inet_set_timeout(client_socket, lftpd->limits.data_idle_timeout);
 
+	// close the listener
+	pthread_mutex_lock(&lftpd->lock);
+	close(client->pasv_socket);
+	client->pasv_socket = -1;
 	client->data_socket = client_socket;
+	pthread_mutex_unlock(&lftpd->lock);
 
 	return 0;
 }
 
-static int cmd_feat(lftpd_client_t* client, const char* arg) {
-	send_multiline_response_begin(client->socket, 211, STATUS_211);
-	send_multiline_response_line(client->socket, "EPSV");
-	send_multiline_response_line(client->socket, "PASV");
-	send_multiline_response_line(client->socket, "SIZE");
-	send_multiline_response_line(client->socket, "NLST");
-	send_multiline_response_end(client->socket, 211, STATUS_211);
-	return 0;
+static char* resolve_path(lftpd_client_t* client, const char* arg) {
+	uint64_t start = TRACE_START(client);
+	char* path = lftpd_io_canonicalize_path(client->directory, arg);
+	TRACE_SPAN(client, "canonicalize", path, start);
+	return path;
 }
 
-static int cmd_list(lftpd_client_t* client, const char* arg) {
-	if (client->data_socket == -1) {
-		send_simple_response(client->socket, 425, STATUS_425);
-		return -1;
-	}
+static int stat_file(lftpd_client_t* client, const char* path, struct stat* st) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	uint64_t start = TRACE_START(client);
+	int err = vfs->stat(vfs, path, st);
+	TRACE_SPAN(client, "stat", path, start);
+	return err;
+}
 
-	send_simple_response(client->socket, 150, STATUS_150);
-	int err = send_list(client->data_socket, client->directory);
-	close(client->data_socket);
-	client->data_socket = -1;
-	if (err == 0) {
-		send_simple_response(client->socket, 226, STATUS_226);
+static void* open_file(lftpd_client_t* client, const char* path, lftpd_vfs_mode_t mode) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	uint64_t start = TRACE_START(client);
+	void* file = vfs->open(vfs, path, mode);
+	TRACE_SPAN(client, "open", path, start);
+	return file;
+}
+
+static void format_list_time(char* buffer, size_t len, time_t mtime, time_t now) {
+	// times are UTC, to agree with MDTM
+	struct tm tm;
+	gmtime_r(&mtime, &tm);
+	if (mtime > now - LIST_RECENT_SECONDS && mtime < now + 60 * 60) {
+		strftime(buffer, len, "%b %e %H:%M", &tm);
 	}
 	else {
-		send_simple_response(client->socket, 550, STATUS_550);
+		strftime(buffer, len, "%b %e  %Y", &tm);
 	}
-	return 0;
 }
 
-static int cmd_nlst(lftpd_client_t* client, const char* arg) {
-	if (client->data_socket == -1) {
-		send_simple_response(client->socket, 425, STATUS_425);
-		return -1;
+/**
+ * @brief Format mtime as the YYYYMMDDHHMMSS UTC time value used by MDTM
+ * and MFMT.
+ */
+static void format_time_val(char* buffer, size_t len, time_t mtime) {
+	struct tm tm;
+	gmtime_r(&mtime, &tm);
+	strftime(buffer, len, "%Y%m%d%H%M%S", &tm);
+}
+
+/**
+ * @brief Parse a YYYYMMDDHHMMSS[.sss] UTC time value, ignoring any
+ * fraction. Returns a pointer to the character after it, or NULL if it
+ * is malformed.
+ */
+static const char* parse_time_val(const char* s, time_t* mtime) {
+	for (int i = 0; i < 14; i++) {
+		if (!isdigit((unsigned char) s[i])) {
+			return NULL;
+		}
+	}
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	sscanf(s, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31
+			|| tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60) {
+		return NULL;
 	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	*mtime = timegm(&tm);
+
+	s += 14;
+	if (*s == '.') {
+		s++;
+		while (isdigit((unsigned char) *s)) {
+			s++;
+		}
+	}
+	return s;
+}
 
-	send_simple_response(client->socket, 150, STATUS_150);
-	int err = send_nlst(client->data_socket, client->directory);
-	close(client->data_socket);
-	client->data_socket = -1;
-	if (err == 0) {
-		send_simple_response(client->socket, 226, STATUS_226);
+/**
+ * @brief State for one LIST or NLST. Lines are gathered in buffer and
+ * written to the data connection a buffer at a time.
+ */
+typedef struct {
+	lftpd_client_t* client;
+	// only entries whose names match are sent, NULL for all
+	const char* pattern;
+	bool recursive;
+	bool names_only;
+	time_t now;
+	char* buffer;
+	size_t len;
+} listing_t;
+
+typedef struct listing_dir {
+	struct listing_dir* next;
+	char name[];
+} listing_dir_t;
+
+/**
+ * @brief A directory on the way down a recursive walk. Symlinks are
+ * followed, so a directory that is already one of these is a loop.
+ */
+typedef struct walk_dir {
+	dev_t dev;
+	ino_t ino;
+	const struct walk_dir* parent;
+} walk_dir_t;
+
+static bool walk_dir_seen(const walk_dir_t* dir, const struct stat* st) {
+	for (; dir; dir = dir->parent) {
+		if (dir->dev == st->st_dev && dir->ino == st->st_ino) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void trim_trailing_slashes(char* path) {
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/') {
+		path[--len] = '\0';
+	}
+}
+
+/**
+ * @brief The separator to put between a directory the client named and
+ * a name in it: none after the root or when listing the current
+ * directory.
+ */
+static const char* path_separator(const char* directory) {
+	size_t len = strlen(directory);
+	return len > 0 && directory[len - 1] != '/' ? "/" : "";
+}
+
+/**
+ * @brief How the top directory is shown. ls -R heads the current
+ * directory with '.'.
+ */
+static const char* listing_heading(listing_t* listing, const char* display) {
+	if (listing->recursive && !listing->names_only && display[0] == '\0') {
+		return ".";
+	}
+	return display;
+}
+
+static int listing_flush(listing_t* listing) {
+	int err = data_write(listing->client, listing->buffer, listing->len);
+	listing->len = 0;
+	return err;
+}
+
+static int listing_line(listing_t* listing, const char* format, ...) {
+	for (int attempt = 0; attempt < 2; attempt++) {
+		size_t space = TRANSFER_BUFFER_SIZE - listing->len;
+		va_list args;
+		va_start(args, format);
+		int n = vsnprintf(listing->buffer + listing->len, space, format, args);
+		va_end(args);
+		if (n < 0) {
+			return -1;
+		}
+		if ((size_t) n + 2 <= space) {
+			memcpy(listing->buffer + listing->len + n, CRLF, 2);
+			listing->len += n + 2;
+			return 0;
+		}
+		if (listing->len == 0) {
+			break;
+		}
+		if (listing_flush(listing) != 0) {
+			return -1;
+		}
+	}
+	lftpd_log_error("listing line too long, skipping");
+	return 0;
+}
+
+/**
+ * @brief Send one entry. LIST shows name as is, NLST prefixes it with
+ * the directory as the client named it, so the names can be fed back
+ * to RETR.
+ */
+static int listing_entry(listing_t* listing, const char* display, const char* name, const struct stat* st) {
+	// https://files.stairways.com/other/ftp-list-specs-info.txt
+	// http://cr.yp.to/ftp/list/binls.html
+	static const char* directory_format = "drw-rw-rw- 1 owner group %13llu %s %s";
+	static const char* file_format = "-rw-rw-rw- 1 owner group %13llu %s %s";
+
+	if (listing->names_only) {
+		if (!S_ISREG(st->st_mode)) {
+			return 0;
+		}
+		return listing_line(listing, "%s%s%s", display, path_separator(display), name);
+	}
+
+	unsigned long long size = st->st_size;
+	char mtime[16];
+	format_list_time(mtime, sizeof(mtime), st->st_mtime, listing->now);
+	if (S_ISDIR(st->st_mode)) {
+		return listing_line(listing, directory_format, size, mtime, name);
+	}
+	if (S_ISREG(st->st_mode)) {
+		return listing_line(listing, file_format, size, mtime, name);
+	}
+	return 0;
+}
+
+/**
+ * @brief List the directory at path, which the client knows as display.
+ * With -R every subdirectory follows, ls -R style, after its parent.
+ */
+static int listing_directory(listing_t* listing, const char* path, const char* display,
+		const walk_dir_t* parent, int depth) {
+	if (depth > LIST_MAX_DEPTH) {
+		lftpd_log_error("directory too deep to list '%s'", path);
+		return 0;
+	}
+
+	lftpd_vfs_t* vfs = listing->client->lftpd->vfs;
+	struct stat dir_st;
+	if (vfs->stat(vfs, path, &dir_st) != 0) {
+		return depth == 0 ? -1 : 0;
+	}
+	if (walk_dir_seen(parent, &dir_st)) {
+		lftpd_log_info("not listing '%s' again, it links back to a parent", path);
+		return 0;
+	}
+	walk_dir_t self = { .dev = dir_st.st_dev, .ino = dir_st.st_ino, .parent = parent };
+
+	void* dir = vfs->opendir(vfs, path);
+	if (dir == NULL) {
+		return depth == 0 ? -1 : 0;
+	}
+
+	int err = 0;
+	if (listing->recursive && !listing->names_only) {
+		err = listing_line(listing, "%s%s:", depth > 0 ? CRLF : "", display);
+	}
+
+	// subdirectories are listed once this one is done, in the order
+	// they were read
+	listing_dir_t* subdirs = NULL;
+	listing_dir_t** subdirs_tail = &subdirs;
+	const char* name;
+	while (err == 0 && (name = vfs->readdir(vfs, dir))) {
+		bool dot = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+		bool matches = listing->pattern == NULL || fnmatch(listing->pattern, name, FNM_PERIOD) == 0;
+		// filter before the stat, unless we need it to find
+		// subdirectories to descend into
+		if (!matches && (!listing->recursive || dot)) {
+			continue;
+		}
+		char* file_path = lftpd_io_canonicalize_path(path, name);
+		struct stat st;
+		if (file_path && vfs->stat(vfs, file_path, &st) == 0) {
+			if (matches) {
+				err = listing_entry(listing, display, name, &st);
+			}
+			if (listing->recursive && !dot && S_ISDIR(st.st_mode)) {
+				listing_dir_t* subdir = malloc(sizeof(listing_dir_t) + strlen(name) + 1);
+				if (subdir) {
+					strcpy(subdir->name, name);
+					subdir->next = NULL;
+					*subdirs_tail = subdir;
+					subdirs_tail = &subdir->next;
+				}
+			}
+		}
+		free(file_path);
+	}
+	vfs->closedir(vfs, dir);
+
+	while (subdirs) {
+		listing_dir_t* subdir = subdirs;
+		subdirs = subdir->next;
+		if (err == 0) {
+			char* subdir_path = lftpd_io_canonicalize_path(path, subdir->name);
+			char* subdir_display = NULL;
+			if (asprintf(&subdir_display, "%s%s%s", display, path_separator(display), subdir->name) < 0) {
+				subdir_display = NULL;
+			}
+			if (subdir_path && subdir_display) {
+				err = listing_directory(listing, subdir_path, subdir_display, &self, depth + 1);
+			}
+			free(subdir_path);
+			free(subdir_display);
+		}
+		free(subdir);
+	}
+
+	return err;
+}
+
+/**
+ * @brief Send the listing for a LIST or NLST argument: ls style options,
+ * of which only -R does anything, then a directory, a file or a glob
+ * pattern in the last path component. Returns -1 if nothing by that
+ * name exists.
+ */
+static int send_listing(lftpd_client_t* client, const char* arg, bool names_only) {
+	listing_t listing = {
+		.client = client,
+		.names_only = names_only,
+		.now = time(NULL),
+	};
+	while (arg && arg[0] == '-') {
+		size_t len = strcspn(arg, " ");
+		if (memchr(arg, 'R', len)) {
+			listing.recursive = true;
+		}
+		arg += len;
+		arg += strspn(arg, " ");
+	}
+	if (arg && arg[0] == '\0') {
+		arg = NULL;
+	}
+
+	listing.buffer = session_alloc(client, TRANSFER_BUFFER_SIZE);
+	if (listing.buffer == NULL) {
+		return -1;
+	}
+
+	// the name as the client gave it, for NLST names and -R headings
+	char* display = strdup(arg ? arg : "");
+	trim_trailing_slashes(display);
+
+	char* path = resolve_path(client, arg);
+	struct stat st;
+	int err = -1;
+	if (arg == NULL || stat_file(client, path, &st) == 0) {
+		if (arg == NULL || S_ISDIR(st.st_mode)) {
+			err = listing_directory(&listing, path, listing_heading(&listing, display), NULL, 0);
+		}
+		else {
+			err = listing_entry(&listing, "", display, &st);
+		}
+	}
+	else {
+		// a pattern in the last component, like *.log or logs/*.log
+		char* name = strrchr(display, '/');
+		name = name ? name + 1 : display;
+		if (strpbrk(name, "*?[")) {
+			listing.pattern = name;
+			char* dir = strndup(display, name - display);
+			trim_trailing_slashes(dir);
+			char* dir_path = resolve_path(client, dir);
+			err = listing_directory(&listing, dir_path, listing_heading(&listing, dir), NULL, 0);
+			free(dir_path);
+			free(dir);
+		}
+	}
+
+	if (err == 0 && listing.len > 0) {
+		err = listing_flush(&listing);
+	}
+	free(path);
+	free(display);
+	session_free(client, listing.buffer, TRANSFER_BUFFER_SIZE);
+	return err;
+}
+
+/**
+ * @brief Send a file small enough for the cache, from the cache if it's
+ * there, otherwise reading and caching it. Returns 1, having sent
+ * nothing, if the session has no memory to spare for reading it whole.
+ */
+static int send_cached_file(lftpd_client_t* client, const char* path, const struct stat* st) {
+	lftpd_cache_t* cache = client->lftpd->cache;
+	lftpd_cache_entry_t* entry = lftpd_cache_get(cache, st);
+	if (entry) {
+		lftpd_log_debug("cache hit '%s'", path);
+		int err = data_write(client, entry->data, entry->size);
+		lftpd_cache_release(cache, entry);
+		return err;
+	}
+
+	// read the whole file, then cache it and send it from memory. The
+	// buffer counts against the session until the cache takes it, and
+	// a session without the room sends the file uncached.
+	size_t size = st->st_size;
+	unsigned char* data = session_alloc(client, size);
+	if (data == NULL) {
+		return 1;
+	}
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	void* file = open_file(client, path, LFTPD_VFS_READ);
+	if (file == NULL) {
+		lftpd_log_error("failed to open file for read");
+		session_free(client, data, size);
+		return -1;
+	}
+	size_t total = 0;
+	ssize_t read_len = 0;
+	while (total < size && (read_len = vfs->read(vfs, file, data + total, size - total)) > 0) {
+		total += read_len;
+	}
+	vfs->close(vfs, file);
+	if (read_len < 0) {
+		lftpd_log_error("read error");
+		session_free(client, data, size);
+		return -1;
+	}
+
+	// if the file shrank underneath us send what we got but don't
+	// cache it
+	entry = total == size ? lftpd_cache_put(cache, st, data) : NULL;
+	if (entry) {
+		// the cache owns the buffer now and counts it in its capacity
+		client->memory_used -= size;
+		int err = data_write(client, entry->data, entry->size);
+		lftpd_cache_release(cache, entry);
+		return err;
+	}
+	int err = data_write(client, data, total);
+	session_free(client, data, size);
+	return err;
+}
+
+// holes in sparse files are sent from here, and shared by every
+// session
+static const unsigned char zero_buffer[TRANSFER_BUFFER_SIZE];
+
+static int send_zeros(lftpd_client_t* client, off_t len) {
+	while (len > 0) {
+		size_t count = len < (off_t) sizeof(zero_buffer) ? (size_t) len : sizeof(zero_buffer);
+		if (data_write(client, zero_buffer, count) != 0) {
+			return -1;
+		}
+		len -= count;
+	}
+	return 0;
+}
+
+/**
+ * @brief Send length bytes of an open file, starting at offset, over
+ * the data connection, or everything up to the end of the file if
+ * length is negative. A file that ends early is padded with zeros so
+ * the receiver always sees exactly length bytes.
+ */
+static int send_file_extent(lftpd_client_t* client, void* file, off_t offset, off_t length) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	off_t end = length < 0 ? -1 : offset + length;
+	off_t start = offset;
+
+	// prefer the zero copy path, falling back to copying through a
+	// buffer if the backend doesn't support it for this file, the data
+	// connection is encrypted in userspace or the data needs block
+	// headers
+	bool copy = vfs->sendfile == NULL || !socket_zero_copy(client->data_socket) || client->block_mode;
+	while (!copy && (end < 0 || offset < end)) {
+		size_t count = SENDFILE_CHUNK_SIZE;
+		if (end >= 0 && end - offset < (off_t) count) {
+			count = end - offset;
+		}
+		if (wait_for_data(client, POLLOUT) != 0) {
+			return -1;
+		}
+		ssize_t sent = vfs->sendfile(vfs, file, client->data_socket, &offset, count);
+		if (sent > 0) {
+			transfer_progress(client, sent);
+			continue;
+		}
+		if (sent < 0) {
+			if (offset == start && (errno == ENOSYS || errno == EINVAL)) {
+				copy = true;
+				break;
+			}
+			lftpd_log_error("write error");
+			return -1;
+		}
+		break;
+	}
+
+	unsigned char* buffer = NULL;
+	int err = 0;
+	if (copy) {
+		buffer = session_alloc(client, TRANSFER_BUFFER_SIZE);
+		if (buffer == NULL) {
+			return -1;
+		}
+		if (vfs->seek(vfs, file, offset, SEEK_SET) < 0) {
+			err = -1;
+			goto done;
+		}
+		while (end < 0 || offset < end) {
+			size_t count = TRANSFER_BUFFER_SIZE;
+			if (end >= 0 && end - offset < (off_t) count) {
+				count = end - offset;
+			}
+			ssize_t read_len = vfs->read(vfs, file, buffer, count);
+			if (read_len < 0) {
+				lftpd_log_error("read error");
+				err = -1;
+				goto done;
+			}
+			if (read_len == 0) {
+				break;
+			}
+			if (data_write(client, buffer, read_len) != 0) {
+				err = -1;
+				goto done;
+			}
+			offset += read_len;
+		}
+	}
+
+	if (end >= 0 && offset < end) {
+		lftpd_log_error("file shrank during transfer, padding");
+		err = send_zeros(client, end - offset);
+	}
+
+	done:
+	session_free(client, buffer, TRANSFER_BUFFER_SIZE);
+	return err;
+}
+
+/**
+ * @brief Like send_file_extent(), but holes in sparse files are found
+ * with SEEK_DATA and SEEK_HOLE and sent as zeros without reading them.
+ * Backends that can't report holes have every byte read.
+ */
+static int send_file_data(lftpd_client_t* client, void* file, off_t offset, off_t length) {
+#ifndef SEEK_DATA
+	return send_file_extent(client, file, offset, length);
+#else
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	off_t end = length < 0 ? -1 : offset + length;
+	while (end < 0 || offset < end) {
+		off_t data = vfs->seek(vfs, file, offset, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) {
+			// there is only a hole between offset and the end of the
+			// file, or we are at the end
+			data = vfs->seek(vfs, file, 0, SEEK_END);
+			if (data <= offset) {
+				break;
+			}
+		}
+		else if (data < 0) {
+			return send_file_extent(client, file, offset, end < 0 ? -1 : end - offset);
+		}
+		if (end >= 0 && data > end) {
+			data = end;
+		}
+		if (send_zeros(client, data - offset) != 0) {
+			return -1;
+		}
+		offset = data;
+		if (end >= 0 && offset >= end) {
+			break;
+		}
+
+		off_t hole = vfs->seek(vfs, file, offset, SEEK_HOLE);
+		if (hole < 0 && errno == ENXIO) {
+			// the data went away, shrunk under us
+			continue;
+		}
+		if (hole <= offset) {
+			return send_file_extent(client, file, offset, end < 0 ? -1 : end - offset);
+		}
+		if (end >= 0 && hole > end) {
+			hole = end;
+		}
+		if (send_file_extent(client, file, offset, hole - offset) != 0) {
+			return -1;
+		}
+		offset = hole;
+	}
+
+	if (end >= 0 && offset < end) {
+		lftpd_log_error("file shrank during transfer, padding");
+		return send_zeros(client, end - offset);
+	}
+	return 0;
+#endif
+}
+
+static int send_file(lftpd_client_t* client, const char* path) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+
+	// small files are served from the shared cache when it's enabled
+	lftpd_cache_t* cache = client->lftpd->cache;
+	struct stat st;
+	if (cache && stat_file(client, path, &st) == 0 && lftpd_cache_accepts(cache, &st)) {
+		int err = send_cached_file(client, path, &st);
+		if (err <= 0) {
+			return err;
+		}
+	}
+
+	void* file = open_file(client, path, LFTPD_VFS_READ);
+	if (file == NULL) {
+		lftpd_log_error("failed to open file for read");
+		return -1;
+	}
+
+	int err = send_file_data(client, file, 0, -1);
+
+	vfs->close(vfs, file);
+
+	return err;
+}
+
+/**
+ * @brief Wait for the watched file to change, servicing the control
+ * connection meanwhile. Returns 0 on a change, 1 if the file stayed
+ * untouched for the data idle timeout, or -1 if the transfer was
+ * aborted or the client closed the data connection.
+ */
+static int wait_for_change(lftpd_client_t* client, int watch) {
+	while (!client->abort_requested) {
+		bool control_pending = control_input_pending(client);
+		// the client never sends on the data connection during a
+		// download, so it only becomes readable when the client hangs up
+		struct pollfd fds[3] = {
+			{ .fd = watch, .events = POLLIN },
+			{ .fd = client->data_socket, .events = POLLIN },
+			{ .fd = client->socket, .events = POLLIN | POLLPRI },
+		};
+		nfds_t nfds = client->deferred_command ? 2 : 3;
+		int timeout = client->lftpd->limits.data_idle_timeout;
+		int ready = poll(fds, nfds, control_pending ? 0 : timeout > 0 ? timeout * 1000 : -1);
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (ready == 0 && !control_pending) {
+			return 1;
+		}
+		if (nfds == 3 && (control_pending || fds[2].revents)) {
+			if (service_control(client) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (fds[1].revents) {
+			lftpd_log_error("data connection closed while following");
+			return -1;
+		}
+		// only that something happened matters, not what
+		char events[4096];
+		while (read(watch, events, sizeof(events)) > 0) {
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * @brief Send the file at path and then whatever is appended to it as
+ * it's written, like tail -f. Ends when the client aborts, the file is
+ * untouched for the data idle timeout, or it is truncated, removed or
+ * replaced, as logs are when they rotate.
+ */
+static int follow_file(lftpd_client_t* client, const char* path) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	struct stat st;
+	void* file = open_file(client, path, LFTPD_VFS_READ);
+	if (file == NULL || vfs->stat(vfs, path, &st) != 0) {
+		lftpd_log_error("failed to open file for read");
+		if (file) {
+			vfs->close(vfs, file);
+		}
+		return -1;
+	}
+	// watch before the first size is taken, so no write is missed
+	int watch = vfs->watch(vfs, path);
+	if (watch < 0) {
+		lftpd_log_error("failed to watch file");
+		vfs->close(vfs, file);
+		return -1;
+	}
+
+	off_t offset = 0;
+	int err = 0;
+	while (err == 0) {
+		off_t size = vfs->seek(vfs, file, 0, SEEK_END);
+		if (size < offset) {
+			lftpd_log_info("followed file truncated");
+			break;
+		}
+		if (size > offset) {
+			err = send_file_data(client, file, offset, size - offset);
+			offset = size;
+			continue;
+		}
+		// everything written to the old file has been sent
+		struct stat now;
+		if (vfs->stat(vfs, path, &now) != 0 || now.st_ino != st.st_ino || now.st_dev != st.st_dev
+				|| now.st_nlink == 0) {
+			lftpd_log_info("followed file removed or replaced");
+			break;
+		}
+		err = wait_for_change(client, watch);
+		if (err == 1) {
+			lftpd_log_info("followed file idle");
+			err = 0;
+			break;
+		}
+	}
+
+	close(watch);
+	vfs->close(vfs, file);
+	return err;
+}
+
+/**
+ * @brief Receives data from the data connection until the client
+ * closes it, passing each piece to sink.
+ */
+typedef int (*data_sink_t)(lftpd_client_t* client, void* context, const unsigned char* buffer, size_t len);
+
+static int receive_data(lftpd_client_t* client, data_sink_t sink, void* context) {
+	unsigned char* buffer = session_alloc(client, TRANSFER_BUFFER_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	int err;
+	while ((err = data_read(client, buffer, TRANSFER_BUFFER_SIZE)) > 0) {
+		if (sink(client, context, buffer, err) != 0) {
+			err = -1;
+			break;
+		}
+	}
+
+	session_free(client, buffer, TRANSFER_BUFFER_SIZE);
+
+	if (err < 0) {
+		return err;
+	}
+
+	return 0;
+}
+
+static int vfs_write_all(lftpd_vfs_t* vfs, void* file, const unsigned char* buffer, size_t len) {
+	while (len > 0) {
+		ssize_t write_len = vfs->write(vfs, file, buffer, len);
+		if (write_len < 0) {
+			lftpd_log_error("failed to write file");
+			return -1;
+		}
+		buffer += write_len;
+		len -= write_len;
+	}
+	return 0;
+}
+
+/**
+ * @brief An upload in progress. Whole blocks of zeros are skipped
+ * rather than written, leaving holes, so offset can run ahead of where
+ * the file was last written.
+ */
+typedef struct {
+	void* file;
+	off_t offset;
+	off_t position;
+	// the start of a block whose remainder hasn't arrived yet
+	unsigned char* block;
+	size_t block_len;
+} upload_t;
+
+static int upload_write(lftpd_client_t* client, upload_t* upload, const unsigned char* buffer, size_t len) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	if (upload->position != upload->offset) {
+		if (vfs->seek(vfs, upload->file, upload->offset, SEEK_SET) < 0) {
+			lftpd_log_error("failed to seek file");
+			return -1;
+		}
+		upload->position = upload->offset;
+	}
+	if (vfs_write_all(vfs, upload->file, buffer, len) != 0) {
+		return -1;
+	}
+	upload->offset += len;
+	upload->position = upload->offset;
+	return 0;
+}
+
+/**
+ * @brief Write whole, aligned blocks, skipping those that are all
+ * zero and writing each run of the others at once.
+ */
+static int upload_blocks(lftpd_client_t* client, upload_t* upload, const unsigned char* buffer, size_t len) {
+	size_t run = 0;
+	for (size_t i = 0; i < len; i += SPARSE_BLOCK_SIZE) {
+		if (!lftpd_io_is_zero(buffer + i, SPARSE_BLOCK_SIZE)) {
+			run += SPARSE_BLOCK_SIZE;
+			continue;
+		}
+		if (run > 0 && upload_write(client, upload, buffer + i - run, run) != 0) {
+			return -1;
+		}
+		run = 0;
+		upload->offset += SPARSE_BLOCK_SIZE;
+	}
+	if (run > 0) {
+		return upload_write(client, upload, buffer + len - run, run);
+	}
+	return 0;
+}
+
+static int upload_sink(lftpd_client_t* client, void* context, const unsigned char* buffer, size_t len) {
+	upload_t* upload = context;
+
+	// data arrives in whatever pieces the network delivers, so finish
+	// any partial block before looking at the rest
+	if (upload->block_len > 0) {
+		size_t count = SPARSE_BLOCK_SIZE - upload->block_len;
+		if (count > len) {
+			count = len;
+		}
+		memcpy(upload->block + upload->block_len, buffer, count);
+		upload->block_len += count;
+		buffer += count;
+		len -= count;
+		if (upload->block_len < SPARSE_BLOCK_SIZE) {
+			return 0;
+		}
+		upload->block_len = 0;
+		if (upload_blocks(client, upload, upload->block, SPARSE_BLOCK_SIZE) != 0) {
+			return -1;
+		}
+	}
+
+	size_t whole = len - len % SPARSE_BLOCK_SIZE;
+	if (upload_blocks(client, upload, buffer, whole) != 0) {
+		return -1;
+	}
+	memcpy(upload->block, buffer + whole, len - whole);
+	upload->block_len = len - whole;
+	return 0;
+}
+
+static int upload_finish(lftpd_client_t* client, upload_t* upload) {
+	if (upload->block_len > 0) {
+		return upload_write(client, upload, upload->block, upload->block_len);
+	}
+	// a file that ends in a hole still needs its last byte written to
+	// have the right size
+	if (upload->position < upload->offset) {
+		upload->offset--;
+		return upload_write(client, upload, zero_buffer, 1);
+	}
+	return 0;
+}
+
+static int receive_file(lftpd_client_t* client, const char* path) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	upload_t upload = { 0 };
+	upload.block = session_alloc(client, SPARSE_BLOCK_SIZE);
+	if (upload.block == NULL) {
+		return -1;
+	}
+	upload.file = open_file(client, path, LFTPD_VFS_WRITE);
+	if (upload.file == NULL) {
+		lftpd_log_error("failed to open file for write");
+		session_free(client, upload.block, SPARSE_BLOCK_SIZE);
+		return -1;
+	}
+
+	int err = receive_data(client, upload_sink, &upload);
+	if (err == 0) {
+		err = upload_finish(client, &upload);
+	}
+
+	if (vfs->close(vfs, upload.file) != 0) {
+		err = -1;
+	}
+	session_free(client, upload.block, SPARSE_BLOCK_SIZE);
+
+	return err;
+}
+
+/**
+ * @brief If path names a synthetic benchmark file, /.bench/zero/<size>
+ * or /.bench/null in the server directory or at the root, return its
+ * name after /.bench/, otherwise NULL.
+ */
+static const char* bench_name(lftpd_client_t* client, const char* path) {
+	const char* directory = client->lftpd->directory;
+	size_t len = strlen(directory);
+	while (len > 0 && directory[len - 1] == '/') {
+		len--;
+	}
+	if (strncmp(path, directory, len) == 0 && path[len] == '/') {
+		path += len;
+	}
+	if (strncmp(path, "/.bench/", 8) != 0) {
+		return NULL;
+	}
+	return path + 8;
+}
+
+/**
+ * @brief Parse a size like 4096, 64K, 100M or 1G, in powers of 1024.
+ * Returns -1 if it isn't one.
+ */
+static off_t parse_bench_size(const char* s) {
+	char* end = NULL;
+	errno = 0;
+	unsigned long long size = strtoull(s, &end, 10);
+	if (end == s || errno != 0) {
+		return -1;
+	}
+	const char* units = "KMGT";
+	const char* unit = *end ? strchr(units, toupper((unsigned char) *end)) : NULL;
+	if (unit) {
+		for (const char* u = units; u <= unit; u++) {
+			if (size > (unsigned long long) INT64_MAX / 1024) {
+				return -1;
+			}
+			size *= 1024;
+		}
+		end++;
+	}
+	if (*end != '\0' || size > (unsigned long long) INT64_MAX) {
+		return -1;
+	}
+	return (off_t) size;
+}
+
+/**
+ * @brief RETR of /.bench/zero/<size> sends size zero bytes without
+ * touching storage. Where a download would go out with sendfile() so
+ * do the zeros, from /dev/zero in the same size chunks. Otherwise they
+ * are copied from memory, as a download would be copied from its file.
+ */
+static int send_bench(lftpd_client_t* client, const char* name) {
+	off_t size = strncmp(name, "zero/", 5) == 0 ? parse_bench_size(name + 5) : -1;
+	if (size < 0) {
+		lftpd_log_error("unknown bench file '%s'", name);
+		return -1;
+	}
+#ifdef __linux__
+	int zero = -1;
+	if (client->lftpd->vfs->sendfile && socket_zero_copy(client->data_socket) && !client->block_mode) {
+		zero = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+	}
+	bool started = false;
+	while (zero >= 0 && size > 0) {
+		size_t count = size < SENDFILE_CHUNK_SIZE ? (size_t) size : SENDFILE_CHUNK_SIZE;
+		if (wait_for_data(client, POLLOUT) != 0) {
+			close(zero);
+			return -1;
+		}
+		// /dev/zero has no position to advance, so no offset is passed
+		ssize_t sent = sendfile(client->data_socket, zero, NULL, count);
+		if (sent > 0) {
+			transfer_progress(client, sent);
+			size -= sent;
+			started = true;
+			continue;
+		}
+		if (sent < 0 && !started && (errno == EINVAL || errno == ENOSYS)) {
+			break;
+		}
+		lftpd_log_error("write error");
+		close(zero);
+		return -1;
+	}
+	if (zero >= 0) {
+		close(zero);
+	}
+#endif
+	return send_zeros(client, size);
+}
+
+static int bench_sink(lftpd_client_t* client, void* context, const unsigned char* buffer, size_t len) {
+	return 0;
+}
+
+/**
+ * @brief STOR to /.bench/null receives the upload through the same data
+ * path as files and discards it, so nothing is written to storage.
+ */
+static int receive_bench(lftpd_client_t* client, const char* name) {
+	if (strcmp(name, "null") != 0) {
+		lftpd_log_error("unknown bench file '%s'", name);
+		return -1;
+	}
+	return receive_data(client, bench_sink, NULL);
+}
+
+/**
+ * @brief Reply to a finished bench transfer with what it achieved: the
+ * rate, the pieces the data was moved in and the polls waiting on the
+ * data connection.
+ */
+static void send_bench_result(lftpd_client_t* client) {
+	double seconds = transfer_seconds(client);
+	double rate = seconds > 0 ? client->transfer_bytes / seconds : 0;
+	lftpd_log_info("bench transferred %llu bytes in %.3f seconds, %lu chunks, %lu polls",
+			client->transfer_bytes, seconds, client->transfer_chunks, client->transfer_polls);
+	send_simple_response(client->socket, client->data_socket == -1 ? 226 : 250, "Transferred %llu bytes in %.3f seconds, %.0f bytes/second, "
+			"%lu chunks, %lu polls.", client->transfer_bytes, seconds, rate,
+			client->transfer_chunks, client->transfer_polls);
+}
+
+/**
+ * @brief If path names a virtual archive, somedir.tar where somedir is
+ * a directory, return the directory path, otherwise NULL. For RETR
+ * (must_be_missing) a real file named somedir.tar takes precedence.
+ */
+static char* tar_directory(lftpd_client_t* client, const char* path, bool must_be_missing) {
+	size_t len = strlen(path);
+	if (len <= 4 || strcmp(path + len - 4, ".tar") != 0) {
+		return NULL;
+	}
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	struct stat st;
+	if (must_be_missing && vfs->stat(vfs, path, &st) == 0) {
+		return NULL;
+	}
+	char* dir = strndup(path, len - 4);
+	if (dir == NULL || vfs->stat(vfs, dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+static int send_tar_directory(lftpd_client_t* client, const char* path, const char* prefix,
+		unsigned char* buffer, const walk_dir_t* parent, int depth) {
+	if (depth > TAR_MAX_DEPTH) {
+		lftpd_log_error("directory too deep for archive '%s'", path);
+		return 0;
+	}
+
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	void* dir = vfs->opendir(vfs, path);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	int err = 0;
+	const char* name;
+	while (err == 0 && (name = vfs->readdir(vfs, dir))) {
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		char* file_path = lftpd_io_canonicalize_path(path, name);
+		char* member = NULL;
+		struct stat st;
+		if (file_path == NULL || vfs->stat(vfs, file_path, &st) != 0) {
+			goto next;
+		}
+		bool is_dir = S_ISDIR(st.st_mode);
+		if (!is_dir && !S_ISREG(st.st_mode)) {
+			goto next;
+		}
+		if (is_dir && walk_dir_seen(parent, &st)) {
+			lftpd_log_info("not archiving '%s' again, it links back to a parent", file_path);
+			goto next;
+		}
+		if (asprintf(&member, "%s%s%s", prefix, name, is_dir ? "/" : "") < 0) {
+			member = NULL;
+			err = -1;
+			goto next;
+		}
+
+		void* file = NULL;
+		if (!is_dir) {
+			file = vfs->open(vfs, file_path, LFTPD_VFS_READ);
+			if (file == NULL) {
+				// unreadable files are left out rather than failing
+				// the whole archive
+				goto next;
+			}
+		}
+
+		size_t header_len = lftpd_tar_header(buffer, TRANSFER_BUFFER_SIZE, member,
+				is_dir ? LFTPD_TAR_TYPE_DIRECTORY : LFTPD_TAR_TYPE_FILE,
+				is_dir ? 0 : st.st_size, st.st_mtime, st.st_mode);
+		if (header_len == 0) {
+			lftpd_log_error("name too long for archive '%s'", member);
+		}
+		else if (data_write(client, buffer, header_len) != 0) {
+			err = -1;
+		}
+		else if (is_dir) {
+			walk_dir_t self = { .dev = st.st_dev, .ino = st.st_ino, .parent = parent };
+			err = send_tar_directory(client, file_path, member, buffer, &self, depth + 1);
+		}
+		else {
+			err = send_file_data(client, file, 0, st.st_size);
+			size_t padding = lftpd_tar_padding(st.st_size);
+			if (err == 0 && padding) {
+				memset(buffer, 0, padding);
+				err = data_write(client, buffer, padding);
+			}
+		}
+		if (file) {
+			vfs->close(vfs, file);
+		}
+
+		next:
+		free(member);
+		free(file_path);
+	}
+
+	vfs->closedir(vfs, dir);
+
+	return err;
+}
+
+static int send_tar(lftpd_client_t* client, const char* path) {
+	unsigned char* buffer = session_alloc(client, TRANSFER_BUFFER_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	struct stat st;
+	if (vfs->stat(vfs, path, &st) != 0) {
+		session_free(client, buffer, TRANSFER_BUFFER_SIZE);
+		return -1;
+	}
+	walk_dir_t top = { .dev = st.st_dev, .ino = st.st_ino, .parent = NULL };
+	int err = send_tar_directory(client, path, "", buffer, &top, 0);
+
+	// two zero blocks end the archive
+	if (err == 0) {
+		memset(buffer, 0, 2 * LFTPD_TAR_BLOCK_SIZE);
+		err = data_write(client, buffer, 2 * LFTPD_TAR_BLOCK_SIZE);
+	}
+
+	session_free(client, buffer, TRANSFER_BUFFER_SIZE);
+
+	return err;
+}
+
+typedef struct {
+	lftpd_client_t* client;
+	const char* directory;
+	lftpd_tar_reader_t reader;
+	void* file;
+} tar_extract_t;
+
+static void tar_extract_close(tar_extract_t* extract) {
+	if (extract->file) {
+		lftpd_vfs_t* vfs = extract->client->lftpd->vfs;
+		vfs->close(vfs, extract->file);
+		extract->file = NULL;
+	}
+}
+
+static int tar_extract_mkdirs(lftpd_vfs_t* vfs, const char* directory, char* path) {
+	// create each missing directory below the extraction directory
+	size_t base_len = strlen(directory);
+	for (char* p = path + base_len + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		struct stat st;
+		int err = 0;
+		if (vfs->stat(vfs, path, &st) != 0) {
+			err = vfs->mkdir(vfs, path);
+		}
+		else if (!S_ISDIR(st.st_mode)) {
+			err = -1;
+		}
+		*p = '/';
+		if (err != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int tar_extract_entry(void* context, const char* name, char type,
+		unsigned long long size, time_t mtime) {
+	tar_extract_t* extract = context;
+	lftpd_vfs_t* vfs = extract->client->lftpd->vfs;
+	tar_extract_close(extract);
+
+	if (type != LFTPD_TAR_TYPE_FILE && type != LFTPD_TAR_TYPE_DIRECTORY) {
+		// links, devices and extended headers are skipped
+		return 0;
+	}
+
+	// resolve the member name inside the directory and refuse anything
+	// that would land outside it
+	char* path = lftpd_io_canonicalize_path(extract->directory, name[0] == '/' ? name + 1 : name);
+	if (path == NULL) {
+		return -1;
+	}
+	if (strcmp(path, extract->directory) == 0) {
+		// ./ and friends
+		free(path);
+		return 0;
+	}
+	size_t base_len = strlen(extract->directory);
+	bool inside = strncmp(path, extract->directory, base_len) == 0
+			&& (path[base_len] == '/' || (base_len == 1 && path[1] != '\0'));
+	if (!inside) {
+		lftpd_log_error("skipping archive member outside directory '%s'", name);
+		free(path);
+		return 0;
+	}
+
+	int err = tar_extract_mkdirs(vfs, extract->directory, path);
+	if (err == 0) {
+		struct stat st;
+		if (type == LFTPD_TAR_TYPE_DIRECTORY) {
+			if (vfs->stat(vfs, path, &st) != 0) {
+				err = vfs->mkdir(vfs, path);
+			}
+		}
+		else {
+			extract->file = vfs->open(vfs, path, LFTPD_VFS_WRITE);
+			if (extract->file == NULL) {
+				err = -1;
+			}
+		}
+	}
+	if (err != 0) {
+		lftpd_log_error("failed to extract '%s'", path);
+	}
+	free(path);
+	return err;
+}
+
+static int tar_extract_data(void* context, const unsigned char* buffer, size_t len) {
+	tar_extract_t* extract = context;
+	if (extract->file == NULL) {
+		return 0;
+	}
+	return vfs_write_all(extract->client->lftpd->vfs, extract->file, buffer, len);
+}
+
+static int tar_sink(lftpd_client_t* client, void* context, const unsigned char* buffer, size_t len) {
+	tar_extract_t* extract = context;
+	return lftpd_tar_reader_feed(&extract->reader, buffer, len);
+}
+
+static int receive_tar(lftpd_client_t* client, const char* path) {
+	tar_extract_t* extract = session_alloc(client, sizeof(tar_extract_t));
+	if (extract == NULL) {
+		return -1;
+	}
+	extract->client = client;
+	extract->directory = path;
+	extract->file = NULL;
+	lftpd_tar_reader_init(&extract->reader, tar_extract_entry, tar_extract_data, extract);
+
+	int err = receive_data(client, tar_sink, extract);
+	if (err == 0 && !lftpd_tar_reader_complete(&extract->reader)) {
+		lftpd_log_error("archive truncated");
+		err = -1;
+	}
+
+	tar_extract_close(extract);
+	session_free(client, extract, sizeof(tar_extract_t));
+
+	return err;
+}
+
+static int cmd_abor(lftpd_client_t* client, const char* arg) {
+	// a transfer in progress handles ABOR itself, so there is none to
+	// abort here beyond a data connection that was never used
+	close_data_connection(client);
+	send_simple_response(client->socket, 226, STATUS_226);
+	return 0;
+}
+
+static int cmd_auth(lftpd_client_t* client, const char* arg) {
+	if (client->lftpd->tls == NULL) {
+		send_simple_response(client->socket, 502, STATUS_502);
+		return 0;
+	}
+	if (client->control_tls) {
+		send_simple_response(client->socket, 503, STATUS_503);
+		return 0;
+	}
+	if (arg == NULL || (strcasecmp(arg, "TLS") != 0 && strcasecmp(arg, "TLS-C") != 0
+			&& strcasecmp(arg, "SSL") != 0)) {
+		send_simple_response(client->socket, 504, STATUS_504);
+		return 0;
+	}
+
+	send_simple_response(client->socket, 234, STATUS_234);
+	// anything sent in the clear after AUTH mustn't pass for a command
+	// sent over TLS
+	client->control_input->len = 0;
+#ifdef LFTPD_TLS
+	client->control_tls = lftpd_tls_accept(client->lftpd->tls, client->socket);
+#endif
+	if (client->control_tls == NULL) {
+		// the connection is in an unknown state, so give up on it
+		lftpd_log_error("error securing control connection");
+		return -1;
+	}
+	return 0;
+}
+
+static int cmd_cwd(lftpd_client_t* client, const char* arg) {
+	if (arg == NULL || strlen(arg) == 0) {
+		send_simple_response(client->socket, 550, STATUS_550);
+	}
+
+	char* path = resolve_path(client, arg);
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+
+	// make sure the path exists
+	struct stat st;
+	if (vfs->stat(vfs, path, &st) != 0) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		free(path);
+		return -1;
+	}
+
+	// make sure the path is a directory
+	if (!S_ISDIR(st.st_mode)) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		free(path);
+		return -1;
+	}
+
+	free(client->directory);
+	client->directory = path;
+	send_simple_response(client->socket, 250, STATUS_250);
+
+	return 0;
+}
+
+static int cmd_dele(lftpd_client_t* client, const char* arg) {
+	if (arg == NULL || strlen(arg) == 0) {
+		send_simple_response(client->socket, 550, STATUS_550);
+	}
+
+	char* path = resolve_path(client, arg);
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+
+	// make sure the path exists
+	struct stat st;
+	if (vfs->stat(vfs, path, &st) != 0) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		free(path);
+		return -1;
+	}
+
+	// make sure the path is a file
+	if (!S_ISREG(st.st_mode)) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		free(path);
+		return -1;
+	}
+
+	vfs->unlink(vfs, path);
+	free(path);
+	send_simple_response(client->socket, 250, STATUS_250);
+
+	return 0;
+}
+
+static int cmd_epsv(lftpd_client_t* client, const char* arg) {
+	// drop any data connection left over from a previous command
+	close_data_connection(client);
+
+	if (!acquire_session_transfer(client)) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		return 0;
+	}
+
+	// open a data port
+	int listener_socket = lftpd_inet_listen(0, 1);
+	if (listener_socket < 0) {
+		release_session_transfer(client);
+		send_simple_response(client->socket, 425, STATUS_425);
+		return -1;
+	}
+
+	// get the port from the new socket, which is random
+	int port = lftpd_inet_get_socket_port(listener_socket);
+
+	// format the response
+	send_simple_response(client->socket, 229, STATUS_229, port);
+
+	return accept_data_connection(client, listener_socket, port);
+}
+
+static int cmd_feat(lftpd_client_t* client, const char* arg) {
+	send_multiline_response_begin(client->socket, 211, STATUS_211);
+	send_multiline_response_line(client->socket, "EPSV");
+	send_multiline_response_line(client->socket, "PASV");
+	send_multiline_response_line(client->socket, "SIZE");
+	send_multiline_response_line(client->socket, "MDTM");
+	send_multiline_response_line(client->socket, "MFMT");
+	if (client->lftpd->tls) {
+		send_multiline_response_line(client->socket, "AUTH TLS");
+		send_multiline_response_line(client->socket, "PBSZ");
+		send_multiline_response_line(client->socket, "PROT");
+	}
+	send_multiline_response_line(client->socket, "NLST");
+	send_multiline_response_end(client->socket, 211, STATUS_211);
+	return 0;
+}
+
+static int cmd_list(lftpd_client_t* client, const char* arg) {
+	if (client->data_socket == -1) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		return -1;
+	}
+
+	if (start_transfer(client) != 0) {
+		return 0;
+	}
+	int err = send_listing(client, arg, false);
+	finish_data_connection(client, false, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
+	if (err == 0) {
+		send_transfer_complete(client);
+	}
+	else {
+		send_simple_response(client->socket, 550, STATUS_550);
+	}
+	return 0;
+}
+
+static int cmd_mdtm(lftpd_client_t* client, const char* arg) {
+	if (!arg) {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
+	}
+
+	char* path = resolve_path(client, arg);
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	struct stat st;
+	if (vfs->stat(vfs, path, &st) == 0) {
+		char mtime[16];
+		format_time_val(mtime, sizeof(mtime), st.st_mtime);
+		send_simple_response(client->socket, 213, "%s", mtime);
+	}
+	else {
+		send_simple_response(client->socket, 550, STATUS_550);
+	}
+	free(path);
+	return 0;
+}
+
+static int cmd_mfmt(lftpd_client_t* client, const char* arg) {
+	// MFMT YYYYMMDDHHMMSS path
+	time_t mtime;
+	const char* name = arg ? parse_time_val(arg, &mtime) : NULL;
+	if (name == NULL || *name != ' ' || name[1] == '\0') {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
+	}
+	name++;
+
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	if (vfs->utime == NULL) {
+		send_simple_response(client->socket, 502, STATUS_502);
+		return 0;
+	}
+
+	char* path = resolve_path(client, name);
+	lftpd_log_debug("set mtime of '%s'", path);
+	if (vfs->utime(vfs, path, mtime) == 0) {
+		char mtime_val[16];
+		format_time_val(mtime_val, sizeof(mtime_val), mtime);
+		send_simple_response(client->socket, 213, "Modify=%s; %s", mtime_val, name);
+	}
+	else {
+		send_simple_response(client->socket, 550, STATUS_550);
+	}
+	free(path);
+	return 0;
+}
+
+static int cmd_mode(lftpd_client_t* client, const char* arg) {
+	bool block;
+	if (arg && strcasecmp(arg, "S") == 0) {
+		block = false;
+	}
+	else if (arg && strcasecmp(arg, "B") == 0) {
+		block = true;
+	}
+	else {
+		send_simple_response(client->socket, 504, STATUS_504);
+		return 0;
+	}
+	if (block != client->block_mode) {
+		// a connection kept open in block mode can't carry a stream
+		close_data_connection(client);
+		client->block_mode = block;
+	}
+	send_simple_response(client->socket, 200, STATUS_200);
+	return 0;
+}
+
+static int cmd_nlst(lftpd_client_t* client, const char* arg) {
+	if (client->data_socket == -1) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		return -1;
+	}
+
+	if (start_transfer(client) != 0) {
+		return 0;
+	}
+	int err = send_listing(client, arg, true);
+	finish_data_connection(client, false, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
+	if (err == 0) {
+		send_transfer_complete(client);
+	}
+	else {
+		send_simple_response(client->socket, 550, STATUS_550);
+	}
+	return 0;
+}
+
+static int cmd_noop(lftpd_client_t* client, const char* arg) {
+	send_simple_response(client->socket, 200, STATUS_200);
+	return 0;
+}
+
+static int cmd_pass(lftpd_client_t* client, const char* arg) {
+	send_simple_response(client->socket, 230, STATUS_230);
+	return 0;
+}
+
+static int cmd_pasv(lftpd_client_t* client, const char* arg) {
+	// drop any data connection left over from a previous command
+	close_data_connection(client);
+
+	if (!acquire_session_transfer(client)) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		return 0;
+	}
+
+	// open a data port
+	int listener_socket = lftpd_inet_listen(0, 1);
+	if (listener_socket < 0) {
+		release_session_transfer(client);
+		send_simple_response(client->socket, 425, STATUS_425);
+		return -1;
+	}
+
+	// get the port from the new socket, which is random
+	int port = lftpd_inet_get_socket_port(listener_socket);
+
+	// get our IP by reading our side of the client's control channel
+	// socket connection
+	struct sockaddr_in client_addr;
+	socklen_t client_addr_len = sizeof(struct sockaddr_in);
+	int err = getsockname(client->socket, (struct sockaddr*) &client_addr, &client_addr_len);
+	if (err != 0) {
+		lftpd_log_error("error getting client IP info");
+		send_simple_response(client->socket, 425, STATUS_425);
+		close(listener_socket);
+		release_session_transfer(client);
+		return -1;
+	}
+
+	// format the response
+	in_addr_t ip = htonl(client_addr.sin_addr.s_addr);
+	send_simple_response(client->socket, 227, STATUS_227,
+			(ip >> 24) & 0xff,
+			(ip >> 16) & 0xff,
+			(ip >> 8) & 0xff,
+			(ip >> 0) & 0xff,
+			(port >> 8) & 0xff, (port >> 0) & 0xff);
+
+	return accept_data_connection(client, listener_socket, port);
+}
+
+static int cmd_pbsz(lftpd_client_t* client, const char* arg) {
+	// TLS has no buffer size, so 0 is all we accept
+	if (client->control_tls == NULL) {
+		send_simple_response(client->socket, 503, STATUS_503);
+		return 0;
+	}
+	send_simple_response(client->socket, 200, "PBSZ=0");
+	return 0;
+}
+
+static int cmd_prot(lftpd_client_t* client, const char* arg) {
+	if (client->control_tls == NULL) {
+		send_simple_response(client->socket, 503, STATUS_503);
+		return 0;
+	}
+	bool protect;
+	if (arg && strcasecmp(arg, "P") == 0) {
+		protect = true;
+	}
+	else if (arg && strcasecmp(arg, "C") == 0) {
+		protect = false;
+	}
+	else {
+		send_simple_response(client->socket, 504, STATUS_504);
+		return 0;
+	}
+	if (protect != client->protect_data) {
+		// a data connection kept open in block mode was set up for
+		// the old protection level
+		close_data_connection(client);
+		client->protect_data = protect;
+	}
+	send_simple_response(client->socket, 200, STATUS_200);
+	return 0;
+}
+
+static int cmd_pwd(lftpd_client_t* client, const char* arg) {
+	send_simple_response(client->socket, 257, "\"%s\"", client->directory);
+	return 0;
+}
+
+static int cmd_quit(lftpd_client_t* client, const char* arg) {
+	send_simple_response(client->socket, 221, STATUS_221);
+	return -1;
+}
+
+static int cmd_retr(lftpd_client_t* client, const char* arg) {
+	if (client->data_socket == -1) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		return -1;
+	}
+
+	if (start_transfer(client) != 0) {
+		return 0;
+	}
+	char* path = resolve_path(client, arg);
+	// the name points into path, which is gone by the reply
+	const char* bench = bench_name(client, path);
+	bool is_bench = bench != NULL;
+	char* tar_dir = bench ? NULL : tar_directory(client, path, true);
+	int err;
+	if (bench) {
+		lftpd_log_debug("send bench '%s'", bench);
+		err = send_bench(client, bench);
+	}
+	else if (tar_dir) {
+		lftpd_log_debug("send archive of '%s'", tar_dir);
+		err = send_tar(client, tar_dir);
+		free(tar_dir);
+	}
+	else {
+		lftpd_log_debug("send '%s'", path);
+		err = send_file(client, path);
+	}
+	free(path);
+	finish_data_connection(client, false, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
+	if (err == 0 && is_bench) {
+		send_bench_result(client);
+	}
+	else if (err == 0) {
+		send_transfer_complete(client);
+	}
+	else {
+		send_simple_response(client->socket, 450, STATUS_450);
+	}
+	return 0;
+}
+
+static int cmd_rnfr(lftpd_client_t* client, const char* arg) {
+	if (!arg) {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
+	}
+
+	char* path = resolve_path(client, arg);
+	struct stat st;
+	if (stat_file(client, path, &st) != 0) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		free(path);
+		return 0;
+	}
+	client->rename_from = path;
+	send_simple_response(client->socket, 350, STATUS_350);
+	return 0;
+}
+
+static int cmd_rnto(lftpd_client_t* client, const char* arg) {
+	char* from = client->rename_from;
+	client->rename_from = NULL;
+	if (from == NULL) {
+		send_simple_response(client->socket, 503, STATUS_503);
+		return 0;
+	}
+	if (!arg) {
+		send_simple_response(client->socket, 501, STATUS_501);
+		free(from);
+		return 0;
+	}
+
+	char* path = resolve_path(client, arg);
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	lftpd_log_debug("rename '%s' to '%s'", from, path);
+	if (vfs->rename(vfs, from, path) == 0) {
+		send_simple_response(client->socket, 250, STATUS_250);
+	}
+	else {
+		send_simple_response(client->socket, 553, STATUS_553);
+	}
+	free(path);
+	free(from);
+	return 0;
+}
+
+static int cmd_site(lftpd_client_t* client, const char* arg) {
+	if (arg == NULL || strlen(arg) == 0) {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
+	}
+
+	// split off the sub command and upper case it
+	char command_tmp[16];
+	size_t index = strcspn(arg, " ");
+	if (index >= sizeof(command_tmp)) {
+		send_simple_response(client->socket, 504, STATUS_504);
+		return 0;
+	}
+	memset(command_tmp, 0, sizeof(command_tmp));
+	memcpy(command_tmp, arg, index);
+	for (int i = 0; command_tmp[i]; i++) {
+		command_tmp[i] = (char) toupper((int) command_tmp[i]);
+	}
+	const char* site_arg = arg[index] ? arg + index + 1 : NULL;
+
+	for (int i = 0; site_commands[i].command; i++) {
+		if (strcmp(site_commands[i].command, command_tmp) == 0) {
+			return site_commands[i].handler(client, site_arg);
+		}
+	}
+	send_simple_response(client->socket, 504, STATUS_504);
+	return 0;
+}
+
+static int cmd_size(lftpd_client_t* client, const char* arg) {
+	if (!arg) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		return 0;
+	}
+
+	char* path = resolve_path(client, arg);
+	lftpd_log_debug("size %s", path);
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	struct stat st;
+	if (vfs->stat(vfs, path, &st) == 0) {
+		send_simple_response(client->socket, 213, "%llu", st.st_size);
+	}
+	else {
+		send_simple_response(client->socket, 550, STATUS_550);
+	}
+	free(path);
+	return 0;
+}
+
+static int cmd_stat(lftpd_client_t* client, const char* arg) {
+	if (arg) {
+		send_simple_response(client->socket, 504, STATUS_504);
+		return 0;
+	}
+	lftpd_t* lftpd = client->lftpd;
+	pthread_mutex_lock(&lftpd->lock);
+	int session_count = lftpd->session_count;
+	int transfer_count = lftpd->transfer_count;
+	pthread_mutex_unlock(&lftpd->lock);
+
+	send_multiline_response_begin(client->socket, 211, "lftpd status:");
+	send_multiline_response_line(client->socket, " Directory %s", client->directory);
+	send_multiline_response_line(client->socket, " Control connection %s", client->control_tls ? "secured" : "in the clear");
+	send_multiline_response_line(client->socket, " Data connections %s", client->protect_data ? "secured" : "in the clear");
+	send_multiline_response_line(client->socket, " %d sessions, %d transfers", session_count, transfer_count);
+	send_multiline_response_line(client->socket, " No transfer in progress");
+	send_multiline_response_end(client->socket, 211, "End of status");
+	return 0;
+}
+
+static int cmd_stor(lftpd_client_t* client, const char* arg) {
+	if (client->data_socket == -1) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		return -1;
+	}
+
+	if (start_transfer(client) != 0) {
+		return 0;
+	}
+	char* path = resolve_path(client, arg);
+	const char* bench = bench_name(client, path);
+	bool is_bench = bench != NULL;
+	// only unpack into a directory when the client asked for it, so
+	// an ordinary upload of somedir.tar still stores the file
+	char* tar_dir = bench || !client->extract_archives ? NULL : tar_directory(client, path, false);
+	int err;
+	if (bench) {
+		lftpd_log_debug("receive bench '%s'", bench);
+		err = receive_bench(client, bench);
+	}
+	else if (tar_dir) {
+		lftpd_log_debug("extract archive into '%s'", tar_dir);
+		err = receive_tar(client, tar_dir);
+		free(tar_dir);
+	}
+	else {
+		lftpd_log_debug("receive '%s'", path);
+		err = receive_file(client, path);
+	}
+	free(path);
+	finish_data_connection(client, true, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
+	if (err == 0 && is_bench) {
+		send_bench_result(client);
+	}
+	else if (err == 0) {
+		send_transfer_complete(client);
+	}
+	else {
+		send_simple_response(client->socket, 450, STATUS_450);
+	}
+	return 0;
+}
+
+static int cmd_syst(lftpd_client_t* client, const char* arg) {
+	send_simple_response(client->socket, 215, "UNIX Type: L8");
+	return 0;
+}
+
+static int cmd_type(lftpd_client_t* client, const char* arg) {
+	send_simple_response(client->socket, 200, STATUS_200);
+	return 0;
+}
+
+static int cmd_user(lftpd_client_t* client, const char* arg) {
+	send_simple_response(client->socket, 230, STATUS_230);
+	return 0;
+}
+
+typedef struct {
+	uint32_t adler;
+	unsigned char md5[LFTPD_MD5_DIGEST_SIZE];
+} block_checksum_t;
+
+struct checksum_pool;
+
+typedef struct {
+	lftpd_vfs_t* vfs;
+	// each worker reads through its own handle so they can run
+	// independently
+	void* file;
+	off_t size;
+	size_t block_size;
+	uint64_t first_block;
+	int block_count;
+	block_checksum_t* results;
+	unsigned char* buffer;
+	int err;
+	struct checksum_pool* pool;
+} checksum_job_t;
+
+/**
+ * @brief The workers for one SITE CHECKSUMS. They are started once and
+ * given their share of each batch in turn, rather than a thread being
+ * started for every batch.
+ */
+typedef struct checksum_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t batch_ready;
+	pthread_cond_t batch_done;
+	// bumped for each new batch, and the workers yet to finish it
+	uint64_t batch;
+	int running;
+	bool stop;
+} checksum_pool_t;
+
+static void checksum_run(checksum_job_t* job) {
+	lftpd_vfs_t* vfs = job->vfs;
+	if (job->block_count <= 0) {
+		return;
+	}
+	off_t offset = (off_t) job->first_block * job->block_size;
+	if (vfs->seek(vfs, job->file, offset, SEEK_SET) < 0) {
+		job->err = -1;
+		return;
+	}
+	for (int i = 0; i < job->block_count; i++) {
+		size_t block_len = job->block_size;
+		if (offset + (off_t) block_len > job->size) {
+			block_len = job->size - offset;
+		}
+		uint32_t adler = 1;
+		lftpd_md5_t md5;
+		lftpd_md5_init(&md5);
+		size_t remaining = block_len;
+		while (remaining > 0) {
+			size_t count = remaining < TRANSFER_BUFFER_SIZE ? remaining : TRANSFER_BUFFER_SIZE;
+			ssize_t read_len = vfs->read(vfs, job->file, job->buffer, count);
+			if (read_len <= 0) {
+				job->err = -1;
+				return;
+			}
+			adler = lftpd_delta_adler32(adler, job->buffer, read_len);
+			lftpd_md5_update(&md5, job->buffer, read_len);
+			remaining -= read_len;
+		}
+		job->results[i].adler = adler;
+		lftpd_md5_final(&md5, job->results[i].md5);
+		offset += block_len;
+	}
+}
+
+static void* checksum_worker(void* arg) {
+	checksum_job_t* job = arg;
+	checksum_pool_t* pool = job->pool;
+	uint64_t seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (!pool->stop && pool->batch == seen) {
+			pthread_cond_wait(&pool->batch_ready, &pool->lock);
+		}
+		if (pool->stop) {
+			break;
+		}
+		seen = pool->batch;
+		pthread_mutex_unlock(&pool->lock);
+		checksum_run(job);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0) {
+			pthread_cond_signal(&pool->batch_done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static int checksum_thread_count(lftpd_client_t* client, size_t results_len) {
+	int threads = client->lftpd->checksum_threads;
+	if (threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (threads > MAX_CHECKSUM_THREADS) {
+		threads = MAX_CHECKSUM_THREADS;
+	}
+	// each thread needs a read buffer, so run as many as the session
+	// can afford rather than failing outright
+	size_t available = session_available(client);
+	if (available > results_len && (available - results_len) / TRANSFER_BUFFER_SIZE < (size_t) threads) {
+		threads = (int) ((available - results_len) / TRANSFER_BUFFER_SIZE);
+	}
+	return threads < 1 ? 1 : threads;
+}
+
+static int send_checksum_line(lftpd_client_t* client, const char* format, ...) {
+	char line[80];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line, sizeof(line) - 2, format, args);
+	va_end(args);
+	if (len < 0 || (size_t) len >= sizeof(line) - 2) {
+		return -1;
+	}
+	memcpy(line + len, CRLF, 2);
+	return data_write(client, line, len + 2);
+}
+
+static int send_checksums(lftpd_client_t* client, const char* path, off_t size, size_t block_size) {
+	uint64_t block_count = size == 0 ? 0 : (size + block_size - 1) / block_size;
+	int err = send_checksum_line(client, "%llu %lu %llu",
+			(unsigned long long) size, (unsigned long) block_size, (unsigned long long) block_count);
+	if (err != 0) {
+		return err;
+	}
+
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	size_t results_len = CHECKSUM_BATCH_BLOCKS * sizeof(block_checksum_t);
+	int threads = checksum_thread_count(client, results_len);
+	block_checksum_t* results = session_alloc(client, results_len);
+	unsigned char* buffers = session_alloc(client, (size_t) threads * TRANSFER_BUFFER_SIZE);
+	checksum_pool_t pool = { .batch = 0 };
+	checksum_job_t jobs[MAX_CHECKSUM_THREADS] = { 0 };
+	pthread_t thread_ids[MAX_CHECKSUM_THREADS];
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.batch_ready, NULL);
+	pthread_cond_init(&pool.batch_done, NULL);
+	int started = 1;
+	if (results == NULL || buffers == NULL) {
+		err = -1;
+		goto done;
+	}
+
+	for (int t = 0; t < threads; t++) {
+		checksum_job_t* job = &jobs[t];
+		job->vfs = vfs;
+		job->file = vfs->open(vfs, path, LFTPD_VFS_READ);
+		job->size = size;
+		job->block_size = block_size;
+		job->buffer = buffers + t * TRANSFER_BUFFER_SIZE;
+		job->pool = &pool;
+		if (job->file == NULL) {
+			err = -1;
+			goto done;
+		}
+	}
+	// the first share of each batch is done on this thread, and if a
+	// thread can't be started the work is split between those that were
+	while (started < threads && pthread_create(&thread_ids[started], NULL, checksum_worker, &jobs[started]) == 0) {
+		started++;
+	}
+
+	// work through the file a batch of blocks at a time, splitting each
+	// batch into contiguous runs, one per thread
+	for (uint64_t first = 0; err == 0 && first < block_count; first += CHECKSUM_BATCH_BLOCKS) {
+		int batch = block_count - first < CHECKSUM_BATCH_BLOCKS ? (int) (block_count - first) : CHECKSUM_BATCH_BLOCKS;
+		int per_thread = (batch + started - 1) / started;
+		for (int t = 0; t < started; t++) {
+			checksum_job_t* job = &jobs[t];
+			int count = batch - t * per_thread < per_thread ? batch - t * per_thread : per_thread;
+			job->first_block = first + t * per_thread;
+			job->block_count = count > 0 ? count : 0;
+			job->results = results + t * per_thread;
+			job->err = 0;
+		}
+		pthread_mutex_lock(&pool.lock);
+		pool.batch++;
+		pool.running = started - 1;
+		pthread_cond_broadcast(&pool.batch_ready);
+		pthread_mutex_unlock(&pool.lock);
+
+		checksum_run(&jobs[0]);
+
+		pthread_mutex_lock(&pool.lock);
+		while (pool.running > 0) {
+			pthread_cond_wait(&pool.batch_done, &pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+		for (int t = 0; t < started; t++) {
+			if (jobs[t].err) {
+				err = -1;
+			}
+		}
+
+		for (int i = 0; err == 0 && i < batch; i++) {
+			char md5[LFTPD_MD5_DIGEST_SIZE * 2 + 1];
+			for (int j = 0; j < LFTPD_MD5_DIGEST_SIZE; j++) {
+				sprintf(md5 + j * 2, "%02x", results[i].md5[j]);
+			}
+			err = send_checksum_line(client, "%08lx %s",
+					(unsigned long) results[i].adler, md5);
+		}
+	}
+
+	done:
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.batch_ready);
+	pthread_mutex_unlock(&pool.lock);
+	for (int t = 1; t < started; t++) {
+		pthread_join(thread_ids[t], NULL);
+	}
+	for (int t = 0; t < threads; t++) {
+		if (jobs[t].file) {
+			vfs->close(vfs, jobs[t].file);
+		}
+	}
+	pthread_cond_destroy(&pool.batch_done);
+	pthread_cond_destroy(&pool.batch_ready);
+	pthread_mutex_destroy(&pool.lock);
+	session_free(client, buffers, (size_t) threads * TRANSFER_BUFFER_SIZE);
+	session_free(client, results, results_len);
+	return err;
+}
+
+static int site_checksums(lftpd_client_t* client, const char* arg) {
+	char* end = NULL;
+	unsigned long block_size = arg ? strtoul(arg, &end, 10) : 0;
+	if (end == NULL || *end != ' ' || block_size < MIN_CHECKSUM_BLOCK_SIZE || block_size > MAX_CHECKSUM_BLOCK_SIZE) {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
+	}
+	char* path = resolve_path(client, end + 1);
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	struct stat st;
+	if (vfs->stat(vfs, path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		free(path);
+		return 0;
+	}
+
+	if (client->data_socket == -1) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		free(path);
+		return 0;
+	}
+
+	if (start_transfer(client) != 0) {
+		free(path);
+		return 0;
+	}
+	lftpd_log_debug("checksums '%s'", path);
+	int err = send_checksums(client, path, st.st_size, block_size);
+	free(path);
+	finish_data_connection(client, false, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
+	if (err == 0) {
+		send_transfer_complete(client);
+	}
+	else {
+		send_simple_response(client->socket, 450, STATUS_450);
+	}
+	return 0;
+}
+
+typedef struct {
+	lftpd_client_t* client;
+	lftpd_delta_reader_t reader;
+	void* original;
+	off_t original_size;
+	void* file;
+	unsigned char* buffer;
+} delta_apply_t;
+
+static int delta_apply_copy(void* context, uint64_t offset, uint32_t len) {
+	delta_apply_t* apply = context;
+	lftpd_vfs_t* vfs = apply->client->lftpd->vfs;
+	if (apply->original == NULL || offset + len > (uint64_t) apply->original_size) {
+		lftpd_log_error("delta copy out of range");
+		return -1;
+	}
+	if (vfs->seek(vfs, apply->original, offset, SEEK_SET) < 0) {
+		return -1;
+	}
+	while (len > 0) {
+		size_t count = len < TRANSFER_BUFFER_SIZE ? len : TRANSFER_BUFFER_SIZE;
+		ssize_t read_len = vfs->read(vfs, apply->original, apply->buffer, count);
+		if (read_len <= 0) {
+			return -1;
+		}
+		if (vfs_write_all(vfs, apply->file, apply->buffer, read_len) != 0) {
+			return -1;
+		}
+		len -= read_len;
+	}
+	return 0;
+}
+
+static int delta_apply_data(void* context, const unsigned char* buffer, size_t len) {
+	delta_apply_t* apply = context;
+	return vfs_write_all(apply->client->lftpd->vfs, apply->file, buffer, len);
+}
+
+static int delta_sink(lftpd_client_t* client, void* context, const unsigned char* buffer, size_t len) {
+	delta_apply_t* apply = context;
+	return lftpd_delta_reader_feed(&apply->reader, buffer, len);
+}
+
+/**
+ * @brief Rebuild path from the delta stream on the data connection
+ * into a temporary file, then move it over the original. The original
+ * is untouched unless the whole stream applies cleanly.
+ */
+static int receive_delta(lftpd_client_t* client, const char* path) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	// concurrent deltas to the same file each build their own copy, so
+	// the one that finishes last wins rather than a mix of both
+	static unsigned long delta_count;
+	unsigned long id = __atomic_add_fetch(&delta_count, 1, __ATOMIC_RELAXED);
+	char* temp_path = NULL;
+	if (asprintf(&temp_path, "%s%s.%ld.%lu", path, DELTA_TEMP_SUFFIX, (long) getpid(), id) < 0) {
+		return -1;
+	}
+
+	int err = -1;
+	delta_apply_t* apply = session_alloc(client, sizeof(delta_apply_t));
+	unsigned char* buffer = session_alloc(client, TRANSFER_BUFFER_SIZE);
+	if (apply == NULL || buffer == NULL) {
+		goto done;
+	}
+	memset(apply, 0, sizeof(delta_apply_t));
+	apply->client = client;
+	apply->buffer = buffer;
+	lftpd_delta_reader_init(&apply->reader, delta_apply_copy, delta_apply_data, apply);
+
+	struct stat st;
+	bool replacing = vfs->stat(vfs, path, &st) == 0 && S_ISREG(st.st_mode);
+	if (replacing) {
+		apply->original = vfs->open(vfs, path, LFTPD_VFS_READ);
+		apply->original_size = st.st_size;
+	}
+	apply->file = vfs->open(vfs, temp_path, LFTPD_VFS_WRITE);
+	if (apply->file == NULL) {
+		lftpd_log_error("failed to open file for write");
+		goto done;
+	}
+
+	err = receive_data(client, delta_sink, apply);
+	if (err == 0 && !apply->reader.finished) {
+		lftpd_log_error("delta stream truncated");
+		err = -1;
+	}
+
+	if (vfs->close(vfs, apply->file) != 0) {
+		err = -1;
+	}
+	apply->file = NULL;
+	// the new file takes the place of the original, so give it the
+	// original's permissions too
+	if (err == 0 && replacing && vfs->chmod) {
+		err = vfs->chmod(vfs, temp_path, st.st_mode & 07777);
+	}
+	if (err == 0) {
+		err = vfs->rename(vfs, temp_path, path);
+	}
+	if (err != 0) {
+		vfs->unlink(vfs, temp_path);
+	}
+
+	done:
+	if (apply && apply->original) {
+		vfs->close(vfs, apply->original);
+	}
+	session_free(client, buffer, TRANSFER_BUFFER_SIZE);
+	session_free(client, apply, sizeof(delta_apply_t));
+	free(temp_path);
+	return err;
+}
+
+static int site_delta(lftpd_client_t* client, const char* arg) {
+	if (arg == NULL || strlen(arg) == 0) {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
+	}
+
+	if (client->data_socket == -1) {
+		send_simple_response(client->socket, 425, STATUS_425);
+		return 0;
+	}
+
+	if (start_transfer(client) != 0) {
+		return 0;
+	}
+	char* path = resolve_path(client, arg);
+	lftpd_log_debug("delta '%s'", path);
+	int err = receive_delta(client, path);
+	free(path);
+	finish_data_connection(client, true, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
+	if (err == 0) {
+		send_transfer_complete(client);
+	}
+	else {
+		send_simple_response(client->socket, 450, STATUS_450);
+	}
+	return 0;
+}
+
+/**
+ * @brief Copy length bytes from the current position of from to the
+ * current position of to with the backend's copy, a chunk at a time so
+ * the control connection is serviced between them. Returns 1 if the
+ * backend can't copy between these files and nothing was copied yet.
+ */
+static int copy_range(lftpd_client_t* client, void* from, void* to, off_t length, bool* copied_any) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	while (length > 0) {
+		if (poll_control(client) != 0) {
+			return -1;
+		}
+		size_t count = length < COPY_CHUNK_SIZE ? length : COPY_CHUNK_SIZE;
+		ssize_t copied = vfs->copy(vfs, from, to, count);
+		if (copied > 0) {
+			*copied_any = true;
+			transfer_progress(client, copied);
+			length -= copied;
+			continue;
+		}
+		if (copied == 0) {
+			// the file shrank under us
+			return 0;
+		}
+		if (!*copied_any && (errno == ENOSYS || errno == EXDEV || errno == EINVAL)) {
+			return 1;
+		}
+		lftpd_log_error("copy error");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Copy the first size bytes of from with the backend's copy.
+ * Kernel copies fill holes in, so where the backend reports holes only
+ * the data between them is copied and the holes are seeked over.
+ */
+static int copy_data(lftpd_client_t* client, void* from, void* to, off_t size) {
+	bool copied_any = false;
+#ifndef SEEK_DATA
+	return copy_range(client, from, to, size, &copied_any);
+#else
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	off_t offset = 0;
+	while (offset < size) {
+		off_t data = vfs->seek(vfs, from, offset, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) {
+			// only a hole is left
+			break;
+		}
+		off_t hole = data < 0 ? size : vfs->seek(vfs, from, data, SEEK_HOLE);
+		if (data < 0) {
+			data = offset;
+		}
+		if (data >= size) {
+			break;
+		}
+		if (hole <= data || hole > size) {
+			hole = size;
+		}
+		transfer_progress(client, data - offset);
+		if (vfs->seek(vfs, from, data, SEEK_SET) != data || vfs->seek(vfs, to, data, SEEK_SET) != data) {
+			return -1;
+		}
+		int err = copy_range(client, from, to, hole - data, &copied_any);
+		if (err != 0) {
+			return err;
+		}
+		offset = hole;
 	}
-	else {
-		send_simple_response(client->socket, 550, STATUS_550);
+
+	// a file that ends in a hole still needs its last byte written to
+	// have the right size
+	if (offset < size) {
+		transfer_progress(client, size - offset);
+		if (vfs->seek(vfs, to, size - 1, SEEK_SET) != size - 1 || vfs->write(vfs, to, zero_buffer, 1) != 1) {
+			return -1;
+		}
 	}
 	return 0;
+#endif
 }
 
-static int cmd_noop(lftpd_client_t* client, const char* arg) {
-	send_simple_response(client->socket, 200, STATUS_200);
-	return 0;
-}
+/**
+ * @brief Copy the open file from into to, the fastest way the backend
+ * allows: a reflink, then copies inside the kernel, then through a
+ * buffer, leaving zero blocks as holes. Returns -1 on error or if the
+ * client aborted.
+ */
+static int copy_file(lftpd_client_t* client, void* from, void* to, off_t size) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	if (vfs->clone && vfs->clone(vfs, from, to) == 0) {
+		transfer_progress(client, size);
+		return 0;
+	}
 
-static int cmd_pass(lftpd_client_t* client, const char* arg) {
-	send_simple_response(client->socket, 230, STATUS_230);
-	return 0;
+	if (vfs->copy) {
+		int err = copy_data(client, from, to, size);
+		if (err != 1) {
+			return err;
+		}
+		// start over through a buffer
+		client->transfer_bytes = 0;
+		if (vfs->seek(vfs, from, 0, SEEK_SET) != 0 || vfs->seek(vfs, to, 0, SEEK_SET) != 0) {
+			return -1;
+		}
+	}
+
+	unsigned char* buffer = session_alloc(client, TRANSFER_BUFFER_SIZE);
+	upload_t upload = { .file = to };
+	upload.block = session_alloc(client, SPARSE_BLOCK_SIZE);
+	int err = buffer && upload.block ? 0 : -1;
+	size_t unpolled = 0;
+	while (err == 0) {
+		if (unpolled >= COPY_CHUNK_SIZE) {
+			unpolled = 0;
+			if (poll_control(client) != 0) {
+				err = -1;
+				break;
+			}
+		}
+		ssize_t read_len = vfs->read(vfs, from, buffer, TRANSFER_BUFFER_SIZE);
+		if (read_len <= 0) {
+			if (read_len < 0) {
+				lftpd_log_error("read error");
+				err = -1;
+			}
+			break;
+		}
+		err = upload_sink(client, &upload, buffer, read_len);
+		transfer_progress(client, read_len);
+		unpolled += read_len;
+	}
+	if (err == 0) {
+		err = upload_finish(client, &upload);
+	}
+	session_free(client, upload.block, SPARSE_BLOCK_SIZE);
+	session_free(client, buffer, TRANSFER_BUFFER_SIZE);
+	return err;
 }
 
-static int cmd_pasv(lftpd_client_t* client, const char* arg) {
-	// open a data port
-	int listener_socket = lftpd_inet_listen(0);
-	if (listener_socket < 0) {
-		send_simple_response(client->socket, 425, STATUS_425);
-		return -1;
+static int site_copy(lftpd_client_t* client, const char* arg) {
+	// SITE COPY <from> <to>, so the source name can't contain spaces
+	const char* space = arg ? strchr(arg, ' ') : NULL;
+	if (space == NULL || space[1] == '\0') {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
 	}
+	char* from_name = strndup(arg, space - arg);
+	char* from = resolve_path(client, from_name);
+	char* to = resolve_path(client, space + 1);
+	free(from_name);
 
-	// get the port from the new socket, which is random
-	int port = lftpd_inet_get_socket_port(listener_socket);
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	struct stat st;
+	struct stat to_st;
+	void* in = NULL;
+	void* out = NULL;
+	if (stat_file(client, from, &st) != 0 || !S_ISREG(st.st_mode)
+			|| (in = open_file(client, from, LFTPD_VFS_READ)) == NULL) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		goto done;
+	}
+	// opening the target truncates it, which mustn't be the source
+	if ((stat_file(client, to, &to_st) == 0 && (S_ISDIR(to_st.st_mode)
+			|| (to_st.st_dev == st.st_dev && to_st.st_ino == st.st_ino)))
+			|| (out = open_file(client, to, LFTPD_VFS_WRITE)) == NULL) {
+		send_simple_response(client->socket, 553, STATUS_553);
+		goto done;
+	}
 
-	// get our IP by reading our side of the client's control channel
-	// socket connection
-	struct sockaddr_in client_addr;
-	socklen_t client_addr_len = sizeof(struct sockaddr_in);
-	int err = getsockname(client->socket, (struct sockaddr*) &client_addr, &client_addr_len);
+	// the copy runs like a transfer, so ABOR stops it and STAT reports
+	// progress
+	lftpd_log_debug("copy '%s' to '%s'", from, to);
+	reset_transfer(client);
+	int err = copy_file(client, in, out, st.st_size);
+	if (vfs->close(vfs, out) != 0) {
+		err = -1;
+	}
+	out = NULL;
 	if (err != 0) {
-		lftpd_log_error("error getting client IP info");
-		send_simple_response(client->socket, 425, STATUS_425);
-		close(listener_socket);
-		return -1;
+		vfs->unlink(vfs, to);
 	}
-
-	// format the response
-	in_addr_t ip = htonl(client_addr.sin_addr.s_addr);
-	send_simple_response(client->socket, 227, STATUS_227,
-			(ip >> 24) & 0xff,
-			(ip >> 16) & 0xff,
-			(ip >> 8) & 0xff,
-			(ip >> 0) & 0xff,
-			(port >> 8) & 0xff, (port >> 0) & 0xff);
-
-	// wait for the connection to the data port
-	lftpd_log_debug("waiting for data port connection on port %d...", port);
-	int client_socket = accept(listener_socket, NULL, NULL);
-	if (client_socket < 0) {
-		lftpd_log_error("error accepting client socket");
-		close(listener_socket);
-		return -1;
+	if (end_transfer(client)) {
+		goto done;
+	}
+	if (err == 0) {
+		send_simple_response(client->socket, 250, STATUS_250);
+	}
+	else {
+		send_simple_response(client->socket, 451, STATUS_451);
 	}
-	lftpd_log_debug("data port connection received...");
-
-	// close the listener
-	close(listener_socket);
-
-	client->data_socket = client_socket;
-
-	return 0;
-}
 
-static int cmd_pwd(lftpd_client_t* client, const char* arg) {
-	send_simple_response(client->socket, 257, "\"%s\"", client->directory);
+	done:
+	if (in) {
+		vfs->close(vfs, in);
+	}
+	if (out) {
+		vfs->close(vfs, out);
+	}
+	free(from);
+	free(to);
 	return 0;
 }
 
-static int cmd_quit(lftpd_client_t* client, const char* arg) {
-	send_simple_response(client->socket, 221, STATUS_221);
-	return -1;
-}
-
-static int cmd_retr(lftpd_client_t* client, const char* arg) {
+static int site_follow(lftpd_client_t* client, const char* arg) {
+	lftpd_vfs_t* vfs = client->lftpd->vfs;
+	if (vfs->watch == NULL) {
+		send_simple_response(client->socket, 502, STATUS_502);
+		return 0;
+	}
+	if (!arg) {
+		send_simple_response(client->socket, 501, STATUS_501);
+		return 0;
+	}
 	if (client->data_socket == -1) {
 		send_simple_response(client->socket, 425, STATUS_425);
-		return -1;
+		return 0;
 	}
 
-	send_simple_response(client->socket, 150, STATUS_150);
-	char* path = lftpd_io_canonicalize_path(client->directory, arg);
-	lftpd_log_debug("send '%s'", path);
-	int err = send_file(client->data_socket, path);
+	char* path = resolve_path(client, arg);
+	struct stat st;
+	if (stat_file(client, path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		send_simple_response(client->socket, 550, STATUS_550);
+		free(path);
+		return 0;
+	}
+	if (start_transfer(client) != 0) {
+		free(path);
+		return 0;
+	}
+	lftpd_log_debug("follow '%s'", path);
+	int err = follow_file(client, path);
 	free(path);
-	close(client->data_socket);
-	client->data_socket = -1;
+	finish_data_connection(client, false, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
 	if (err == 0) {
-		send_simple_response(client->socket, 226, STATUS_226);
+		send_transfer_complete(client);
 	}
 	else {
 		send_simple_response(client->socket, 450, STATUS_450);
@@ -451,146 +3391,340 @@ static int cmd_retr(lftpd_client_t* client, const char* arg) {
 	return 0;
 }
 
-static int cmd_size(lftpd_client_t* client, const char* arg) {
-	if (!arg) {
-		send_simple_response(client->socket, 550, STATUS_550);
-		return 0;
+static int site_extract(lftpd_client_t* client, const char* arg) {
+	if (arg && strcasecmp(arg, "ON") == 0) {
+		client->extract_archives = true;
 	}
-
-	char* path = lftpd_io_canonicalize_path(client->directory, arg);
-	lftpd_log_debug("size %s", path);
-	struct stat st;
-	if (stat(path, &st) == 0) {
-		send_simple_response(client->socket, 213, "%llu", st.st_size);
+	else if (arg && strcasecmp(arg, "OFF") == 0) {
+		client->extract_archives = false;
 	}
 	else {
-		send_simple_response(client->socket, 550, STATUS_550);
+		send_simple_response(client->socket, 504, STATUS_504);
+		return 0;
 	}
-	free(path);
+	send_simple_response(client->socket, 200, STATUS_200);
 	return 0;
 }
 
-static int cmd_stor(lftpd_client_t* client, const char* arg) {
+static int site_stats(lftpd_client_t* client, const char* arg) {
+	lftpd_t* lftpd = client->lftpd;
+	lftpd_stats_t stats;
+	lftpd_get_stats(lftpd, &stats);
+	pthread_mutex_lock(&lftpd->lock);
+	int sessions = lftpd->session_count;
+	int transfers = lftpd->transfer_count;
+	pthread_mutex_unlock(&lftpd->lock);
+
+	send_multiline_response_begin(client->socket, 211, STATUS_211);
+	send_multiline_response_line(client->socket, " sessions_active %d", sessions);
+	send_multiline_response_line(client->socket, " sessions_accepted %lu", stats.sessions_accepted);
+	send_multiline_response_line(client->socket, " sessions_rejected %lu", stats.sessions_rejected);
+	send_multiline_response_line(client->socket, " transfers_active %d", transfers);
+	send_multiline_response_line(client->socket, " transfers_rejected %lu", stats.transfers_rejected);
+	send_multiline_response_line(client->socket, " cache_hits %lu", stats.cache_hits);
+	send_multiline_response_line(client->socket, " cache_misses %lu", stats.cache_misses);
+	send_multiline_response_end(client->socket, 211, STATUS_211);
+	return 0;
+}
+
+static int trace_data_writer(void* context, const void* buffer, size_t len) {
+	return data_write(context, buffer, len);
+}
+
+static int site_trace(lftpd_client_t* client, const char* arg) {
+	if (client->lftpd->trace == NULL) {
+		send_simple_response(client->socket, 502, STATUS_502);
+		return 0;
+	}
 	if (client->data_socket == -1) {
 		send_simple_response(client->socket, 425, STATUS_425);
-		return -1;
+		return 0;
 	}
 
-	send_simple_response(client->socket, 150, STATUS_150);
-	char* path = lftpd_io_canonicalize_path(client->directory, arg);
-	lftpd_log_debug("receive '%s'", path);
-	int err = receive_file(client->data_socket, path);
-	free(path);
-	close(client->data_socket);
-	client->data_socket = -1;
+	if (start_transfer(client) != 0) {
+		return 0;
+	}
+	int err = lftpd_trace_dump(client->lftpd->trace, trace_data_writer, client);
+	finish_data_connection(client, false, err);
+	if (end_transfer(client)) {
+		return 0;
+	}
 	if (err == 0) {
-		send_simple_response(client->socket, 226, STATUS_226);
+		send_transfer_complete(client);
 	}
 	else {
-		send_simple_response(client->socket, 450, STATUS_450);
+		send_simple_response(client->socket, 451, STATUS_451);
 	}
 	return 0;
 }
 
-static int cmd_syst(lftpd_client_t* client, const char* arg) {
-	send_simple_response(client->socket, 215, "UNIX Type: L8");
-	return 0;
-}
+/**
+ * @brief Parse one command line from the client and run its handler.
+ * Returns non-zero when the session should end.
+ */
+static int dispatch_command(lftpd_client_t* client, const char* line) {
+	// find the index of the first space, or use the whole string if
+	// there is none
+	size_t index = strcspn(line, " ");
+
+	// if the index is 5 or greater the command is too long
+	if (index >= 5) {
+		return send_simple_response(client->socket, 500, STATUS_500);
+	}
 
-static int cmd_type(lftpd_client_t* client, const char* arg) {
-	send_simple_response(client->socket, 200, STATUS_200);
-	return 0;
-}
+	// copy the command into a temporary buffer
+	char command_tmp[4 + 1];
+	memset(command_tmp, 0, sizeof(command_tmp));
+	memcpy(command_tmp, line, index);
 
-static int cmd_user(lftpd_client_t* client, const char* arg) {
-	send_simple_response(client->socket, 230, STATUS_230);
+	// upper case the command
+	for (int i = 0; command_tmp[i]; i++) {
+		command_tmp[i] = (char) toupper((int) command_tmp[i]);
+	}
+
+	// see if we have a matching function for the command, and if
+	// so, dispatch it
+	for (int i = 0; commands[i].command; i++) {
+		if (strcmp(commands[i].command, command_tmp) == 0) {
+			char* arg_tmp = NULL;
+			char* arg = NULL;
+			if (index < strlen(line)) {
+				arg_tmp = strdup(line + index + 1);
+				arg = lftpd_string_trim(arg_tmp);
+			}
+			// RNTO has to come straight after RNFR
+			if (client->rename_from && commands[i].handler != cmd_rnto) {
+				free(client->rename_from);
+				client->rename_from = NULL;
+			}
+			uint64_t start = TRACE_START(client);
+			int err = commands[i].handler(client, arg);
+			// never keep passwords in the trace
+			TRACE_SPAN(client, commands[i].command,
+					strcmp(commands[i].command, "PASS") == 0 ? NULL : arg, start);
+			free(arg_tmp);
+			return err;
+		}
+	}
+
+	send_simple_response(client->socket, 502, STATUS_502);
 	return 0;
 }
 
 static int handle_control_channel(lftpd_client_t* client) {
+	size_t read_buffer_len = CONTROL_BUFFER_SIZE;
+	char* read_buffer = session_alloc(client, read_buffer_len);
+	client->control_input = session_alloc(client, sizeof(lftpd_inet_line_buffer_t));
+	if (read_buffer == NULL || client->control_input == NULL) {
+		send_simple_response(client->socket, 421, STATUS_421);
+		goto cleanup;
+	}
+	client->control_input->len = 0;
+
 	int err = send_simple_response(client->socket, 220, STATUS_220);
 	if (err != 0) {
 		lftpd_log_error("error sending welcome message");
 		goto cleanup;
 	}
 
-	size_t read_buffer_len = 512;
-	char* read_buffer = malloc(read_buffer_len);
-	while (err == 0) {
-		int line_len = lftpd_inet_read_line(client->socket, read_buffer, read_buffer_len);
+	// a client that goes quiet is dropped after the idle timeout
+	lftpd_inet_set_timeout(client->socket, client->lftpd->limits.control_idle_timeout);
+
+	// SO_OOBINLINE keeps the Synch some clients send with ABOR in the
+	// stream, where strip_telnet() removes it
+	lftpd_inet_set_oob_inline(client->socket);
+	lftpd_inet_set_nodelay(client->socket);
+
+	while (err == 0 && !client->quit_requested) {
+		if (client->deferred_command) {
+			// run a command that arrived during the last transfer
+			char* command = client->deferred_command;
+			client->deferred_command = NULL;
+			err = dispatch_command(client, command);
+			session_free(client, command, CONTROL_BUFFER_SIZE);
+			continue;
+		}
+
+		int line_len = socket_read_line(client->socket, client->control_input, read_buffer, read_buffer_len, true);
 		if (line_len != 0) {
-			lftpd_log_error("error reading next command");
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				lftpd_log_info("control connection idle, closing");
+				send_simple_response(client->socket, 421, STATUS_421);
+			}
+			else {
+				lftpd_log_error("error reading next command");
+			}
 			goto cleanup;
 		}
 
-		// find the index of the first space
-		int index;
-		char* p = strchr(read_buffer, ' ');
-		if (p != NULL) {
-			index = p - read_buffer;
-		}
-		// if no space, use the whole string
-		else {
-			index = strlen(read_buffer);
-		}
+		strip_telnet(read_buffer);
+		err = dispatch_command(client, read_buffer);
+	}
 
-		// if the index is 5 or greater the command is too long
-		if (index >= 5) {
-			err = send_simple_response(client->socket, 500, STATUS_500);
-			continue;
-		}
+	cleanup:
+	session_free(client, read_buffer, read_buffer_len);
+	session_free(client, client->control_input, sizeof(lftpd_inet_line_buffer_t));
+	client->control_input = NULL;
+	session_free(client, client->deferred_command, CONTROL_BUFFER_SIZE);
+	client->deferred_command = NULL;
+	free(client->rename_from);
+	client->rename_from = NULL;
+	close_data_connection(client);
+#ifdef LFTPD_TLS
+	lftpd_tls_close(client->control_tls);
+	client->control_tls = NULL;
+#endif
+	close_session_socket(client, &client->socket);
 
-		// copy the command into a temporary buffer
-		char command_tmp[4 + 1];
-		memset(command_tmp, 0, sizeof(command_tmp));
-		memcpy(command_tmp, read_buffer, index);
+	return 0;
+}
 
-		// upper case the command
-		for (int i = 0; command_tmp[i]; i++) {
-			command_tmp[i] = (char) toupper((int) command_tmp[i]);
-		}
+static int resolve_limit(int value, int default_value) {
+	if (value == 0) {
+		return default_value;
+	}
+	return value;
+}
 
-		// see if we have a matching function for the command, and if
-		// so, dispatch it
-		bool matched = false;
-		for (int i = 0; commands[i].command; i++) {
-			if (strcmp(commands[i].command, command_tmp) == 0) {
-				char* arg = NULL;
-				if (index < strlen(read_buffer)) {
-					arg = strdup(read_buffer + index + 1);
-					arg = lftpd_string_trim(arg);
-				}
-				err = commands[i].handler(client, arg);
-				free(arg);
-				matched = true;
-				break;
+static void resolve_limits(lftpd_limits_t* limits) {
+	limits->max_sessions = resolve_limit(limits->max_sessions, DEFAULT_MAX_SESSIONS);
+	limits->max_sessions_per_ip = resolve_limit(limits->max_sessions_per_ip, DEFAULT_MAX_SESSIONS_PER_IP);
+	limits->max_transfers = resolve_limit(limits->max_transfers, DEFAULT_MAX_TRANSFERS);
+	limits->listen_backlog = resolve_limit(limits->listen_backlog, DEFAULT_LISTEN_BACKLOG);
+	limits->control_idle_timeout = resolve_limit(limits->control_idle_timeout, DEFAULT_CONTROL_IDLE_TIMEOUT);
+	limits->data_idle_timeout = resolve_limit(limits->data_idle_timeout, DEFAULT_DATA_IDLE_TIMEOUT);
+	if (limits->session_memory == 0) {
+		limits->session_memory = DEFAULT_SESSION_MEMORY;
+	}
+	// the backlog has no unlimited value, so fall back to the default
+	if (limits->listen_backlog < 0) {
+		limits->listen_backlog = DEFAULT_LISTEN_BACKLOG;
+	}
+}
+
+/**
+ * @brief Decide whether a new client from address may start a session
+ * and, if so, add it to the session list. Must be called with the lock
+ * held.
+ */
+static bool admit_session(lftpd_t* lftpd, lftpd_client_t* client) {
+	if (lftpd->limits.max_sessions >= 0 && lftpd->session_count >= lftpd->limits.max_sessions) {
+		return false;
+	}
+
+	if (lftpd->limits.max_sessions_per_ip >= 0) {
+		int count = 0;
+		for (lftpd_client_t* c = lftpd->clients; c; c = c->next) {
+			if (memcmp(&c->address, &client->address, sizeof(struct in6_addr)) == 0) {
+				count++;
 			}
 		}
-		if (!matched) {
-			send_simple_response(client->socket, 502, STATUS_502);
+		if (count >= lftpd->limits.max_sessions_per_ip) {
+			return false;
 		}
 	}
 
-	cleanup:
-	close(client->socket);
+	client->next = lftpd->clients;
+	lftpd->clients = client;
+	lftpd->session_count++;
+	return true;
+}
 
-	return 0;
+static void remove_session(lftpd_t* lftpd, lftpd_client_t* client) {
+	pthread_mutex_lock(&lftpd->lock);
+	for (lftpd_client_t** p = &lftpd->clients; *p; p = &(*p)->next) {
+		if (*p == client) {
+			*p = client->next;
+			break;
+		}
+	}
+	lftpd->session_count--;
+	pthread_cond_broadcast(&lftpd->sessions_done);
+	pthread_mutex_unlock(&lftpd->lock);
+}
+
+static void* session_thread(void* arg) {
+	lftpd_client_t* client = arg;
+	lftpd_t* lftpd = client->lftpd;
+#ifdef LFTPD_TLS
+	thread_client = client;
+#endif
+	if (lftpd->trace) {
+		client->trace = lftpd_trace_attach(lftpd->trace);
+	}
+	uint64_t start = TRACE_START(client);
+	handle_control_channel(client);
+	if (client->trace) {
+		// label the session with the client it served
+		char ip[INET6_ADDRSTRLEN];
+		inet_ntop(AF_INET6, &client->address, ip, sizeof(ip));
+		lftpd_trace_span(client->trace, "session", ip, start);
+		lftpd_trace_detach(lftpd->trace, client->trace);
+	}
+	remove_session(lftpd, client);
+	free(client->directory);
+	free(client);
+	return NULL;
 }
 
 int lftpd_start(const char* directory, int port, lftpd_t* lftpd) {
-	memset(lftpd, 0, sizeof(lftpd_t));
+	static lftpd_vfs_t posix_vfs;
+	if (lftpd->vfs == NULL) {
+		lftpd_vfs_posix_init(&posix_vfs);
+		lftpd->vfs = &posix_vfs;
+	}
 
 	lftpd->directory = directory;
 	lftpd->port = port;
-	lftpd->server_socket = lftpd_inet_listen(port);
+	lftpd->clients = NULL;
+	lftpd->cache = NULL;
+	lftpd->tls = NULL;
+	lftpd->trace = NULL;
+	lftpd->session_count = 0;
+	lftpd->transfer_count = 0;
+	lftpd->stopping = false;
+	resolve_limits(&lftpd->limits);
+	pthread_mutex_init(&lftpd->lock, NULL);
+	pthread_cond_init(&lftpd->sessions_done, NULL);
+
+	if (lftpd->cache_capacity > 0) {
+		size_t max_file_size = lftpd->cache_max_file_size;
+		if (max_file_size == 0) {
+			max_file_size = DEFAULT_CACHE_MAX_FILE_SIZE;
+		}
+		lftpd->cache = malloc(sizeof(lftpd_cache_t));
+		if (lftpd->cache) {
+			lftpd_cache_init(lftpd->cache, lftpd->cache_capacity, max_file_size);
+		}
+	}
+
+	if (lftpd->trace_events > 0) {
+		lftpd->trace = lftpd_trace_create(lftpd->trace_events);
+	}
+
+	int err = -1;
+	if (lftpd->tls_certificate && lftpd->tls_key) {
+#ifdef LFTPD_TLS
+		lftpd->tls = lftpd_tls_context_create(lftpd->tls_certificate, lftpd->tls_key);
+		if (lftpd->tls == NULL) {
+			goto cleanup;
+		}
+#else
+		// refuse to silently serve in the clear
+		lftpd_log_error("TLS requested but lftpd was built without TLS support");
+		goto cleanup;
+#endif
+	}
+
+	lftpd->server_socket = lftpd_inet_listen(port, lftpd->limits.listen_backlog);
 	if (lftpd->server_socket < 0) {
 		lftpd_log_error("error creating listener");
-		return -1;
+		goto cleanup;
 	}
 
 	struct sockaddr_in6 server_addr;
 	socklen_t server_addr_len = sizeof(struct sockaddr_in6);
-	int err = getsockname(lftpd->server_socket, (struct sockaddr*) &server_addr, &server_addr_len);
+	err = getsockname(lftpd->server_socket, (struct sockaddr*) &server_addr, &server_addr_len);
 	if (err != 0) {
 		lftpd_log_error("error getting server IP info");
 	}
@@ -606,12 +3740,23 @@ int lftpd_start(const char* directory, int port, lftpd_t* lftpd) {
 
 		int client_socket = accept(lftpd->server_socket, NULL, NULL);
 		if (client_socket < 0) {
-			lftpd_log_error("error accepting client socket");
-			break;
+			if (__atomic_load_n(&lftpd->stopping, __ATOMIC_ACQUIRE) || errno == EBADF || errno == EINVAL
+					|| errno == ENOTSOCK) {
+				break;
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			// out of descriptors or memory: keep the sessions we have
+			// and try again once some have finished
+			lftpd_log_error("error accepting client socket: %s", strerror(errno));
+			nanosleep(&(struct timespec) { .tv_sec = 0, .tv_nsec = ACCEPT_RETRY_DELAY_NS }, NULL);
+			continue;
 		}
 
 		struct sockaddr_in6 client_addr;
 		socklen_t client_addr_len = sizeof(struct sockaddr_in6);
+		memset(&client_addr, 0, sizeof(client_addr));
 		int err = getpeername(client_socket, (struct sockaddr*) &client_addr, &client_addr_len);
 		if (err != 0) {
 			lftpd_log_error("error getting client IP info");
@@ -624,34 +3769,141 @@ int lftpd_start(const char* directory, int port, lftpd_t* lftpd) {
 			lftpd_log_info("connection received from [%s]:%d...", ip, port);
 		}
 
-		lftpd_client_t client = {
-				.directory = strdup(directory),
-				.socket = client_socket,
-				.data_socket = -1,
-		};
-		lftpd->client = &client;
-		handle_control_channel(&client);
-		free(client.directory);
-		lftpd->client = NULL;
+		lftpd_client_t* client = calloc(1, sizeof(lftpd_client_t));
+		if (client == NULL) {
+			send_simple_response(client_socket, 421, STATUS_421);
+			close(client_socket);
+			continue;
+		}
+		client->lftpd = lftpd;
+		client->socket = client_socket;
+		client->data_socket = -1;
+		client->pasv_socket = -1;
+		client->address = client_addr.sin6_addr;
+
+		// over limit clients are turned away immediately rather than
+		// left waiting in the backlog
+		pthread_mutex_lock(&lftpd->lock);
+		bool admitted = admit_session(lftpd, client);
+		if (!admitted) {
+			lftpd->stats.sessions_rejected++;
+		}
+		else {
+			lftpd->stats.sessions_accepted++;
+		}
+		pthread_mutex_unlock(&lftpd->lock);
+		if (!admitted) {
+			lftpd_log_info("session limit reached, rejecting connection");
+			send_simple_response(client_socket, 421, STATUS_421);
+			close(client_socket);
+			free(client);
+			continue;
+		}
+
+		client->directory = strdup(directory);
+
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = pthread_create(&thread, &attr, session_thread, client);
+		pthread_attr_destroy(&attr);
+		if (err != 0) {
+			lftpd_log_error("error creating session thread");
+			send_simple_response(client_socket, 421, STATUS_421);
+			remove_session(lftpd, client);
+			close(client_socket);
+			free(client->directory);
+			free(client);
+		}
 	}
 
 	close(lftpd->server_socket);
 
-	return 0;
+	// wait for the sessions to wind down before tearing down the lock
+	pthread_mutex_lock(&lftpd->lock);
+	while (lftpd->session_count > 0) {
+		pthread_cond_wait(&lftpd->sessions_done, &lftpd->lock);
+	}
+	pthread_mutex_unlock(&lftpd->lock);
+	err = 0;
+
+	cleanup:
+#ifdef LFTPD_TLS
+	lftpd_tls_context_destroy(lftpd->tls);
+	lftpd->tls = NULL;
+#endif
+	if (lftpd->cache) {
+		lftpd_cache_destroy(lftpd->cache);
+		free(lftpd->cache);
+		lftpd->cache = NULL;
+	}
+	lftpd_trace_destroy(lftpd->trace);
+	lftpd->trace = NULL;
+	pthread_cond_destroy(&lftpd->sessions_done);
+	pthread_mutex_destroy(&lftpd->lock);
+
+	return err;
+}
+
+void lftpd_get_stats(lftpd_t* lftpd, lftpd_stats_t* stats) {
+	pthread_mutex_lock(&lftpd->lock);
+	*stats = lftpd->stats;
+	pthread_mutex_unlock(&lftpd->lock);
+	lftpd_cache_t* cache = lftpd->cache;
+	if (cache) {
+		pthread_mutex_lock(&cache->lock);
+		stats->cache_hits = cache->hits;
+		stats->cache_misses = cache->misses;
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+
+static int trace_file_writer(void* context, const void* buffer, size_t len) {
+	return fwrite(buffer, 1, len, context) == len ? 0 : -1;
+}
+
+int lftpd_dump_trace(lftpd_t* lftpd, FILE* file) {
+	if (lftpd->trace == NULL) {
+		return -1;
+	}
+	return lftpd_trace_dump(lftpd->trace, trace_file_writer, file);
 }
 
 int lftpd_stop(lftpd_t* lftpd) {
-	close(lftpd->server_socket);
-	if (lftpd->client) {
-		close(lftpd->client->socket);
+	__atomic_store_n(&lftpd->stopping, true, __ATOMIC_RELEASE);
+	// shutdown rather than close so that threads blocked on these
+	// sockets wake up and clean up after themselves
+	shutdown(lftpd->server_socket, SHUT_RDWR);
+	pthread_mutex_lock(&lftpd->lock);
+	// sessions close their sockets under the lock, so these are still
+	// theirs, and shutting down the listener and the data connection
+	// wakes a session waiting in PASV or in the middle of a transfer
+	for (lftpd_client_t* client = lftpd->clients; client; client = client->next) {
+		int sockets[] = { client->socket, client->pasv_socket, client->data_socket };
+		for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]); i++) {
+			if (sockets[i] >= 0) {
+				shutdown(sockets[i], SHUT_RDWR);
+			}
+		}
 	}
+	pthread_mutex_unlock(&lftpd->lock);
 	return 0;
 }
 
+#ifndef LFTPD_NO_MAIN
 int main( int argc, char *argv[] ) {
+	// a client hanging up mid transfer shouldn't take the server down
+	signal(SIGPIPE, SIG_IGN);
+
 	char* cwd = getcwd(NULL, 0);
-	lftpd_t lftpd;
+	lftpd_t lftpd = { 0 };
+	// lftpd [certificate.pem key.pem] enables AUTH TLS
+	if (argc == 3) {
+		lftpd.tls_certificate = argv[1];
+		lftpd.tls_key = argv[2];
+	}
 	lftpd_start(cwd, 2121, &lftpd);
 	free(cwd);
 }
-
+#endif
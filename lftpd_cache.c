@@ -0,0 +1,178 @@
+#include "private/lftpd_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static long long cache_mtime(const struct stat* st) {
+#ifdef __linux__
+	// include nanoseconds where we have them so a rewrite within the
+	// same second still changes the key
+	return (long long) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+	return (long long) st->st_mtime;
+#endif
+}
+
+static long long cache_ctime(const struct stat* st) {
+	// the modification time can be set by clients, but not this
+#ifdef __linux__
+	return (long long) st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+#else
+	return (long long) st->st_ctime;
+#endif
+}
+
+static unsigned int cache_bucket(dev_t dev, ino_t ino) {
+	unsigned long long h = ((unsigned long long) dev * 31) ^ (unsigned long long) ino;
+	h ^= h >> 17;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned int) (h >> 32) % LFTPD_CACHE_BUCKETS;
+}
+
+static void lru_unlink(lftpd_cache_t* cache, lftpd_cache_entry_t* entry) {
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else {
+		cache->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else {
+		cache->lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void lru_push(lftpd_cache_t* cache, lftpd_cache_entry_t* entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = entry;
+	}
+	cache->lru_head = entry;
+	if (cache->lru_tail == NULL) {
+		cache->lru_tail = entry;
+	}
+}
+
+static void entry_free(lftpd_cache_entry_t* entry) {
+	free(entry->data);
+	free(entry);
+}
+
+/**
+ * @brief Remove an entry from the cache. It is freed now if nobody is
+ * using it, otherwise by the last lftpd_cache_release(). Must be called
+ * with the lock held.
+ */
+static void entry_evict(lftpd_cache_t* cache, lftpd_cache_entry_t* entry) {
+	unsigned int bucket = cache_bucket(entry->dev, entry->ino);
+	for (lftpd_cache_entry_t** p = &cache->buckets[bucket]; *p; p = &(*p)->bucket_next) {
+		if (*p == entry) {
+			*p = entry->bucket_next;
+			break;
+		}
+	}
+	lru_unlink(cache, entry);
+	entry->linked = false;
+	cache->used -= entry->size;
+	if (entry->refs == 0) {
+		entry_free(entry);
+	}
+}
+
+int lftpd_cache_init(lftpd_cache_t* cache, size_t capacity, size_t max_file_size) {
+	memset(cache, 0, sizeof(lftpd_cache_t));
+	cache->capacity = capacity;
+	cache->max_file_size = max_file_size > capacity ? capacity : max_file_size;
+	return pthread_mutex_init(&cache->lock, NULL);
+}
+
+void lftpd_cache_destroy(lftpd_cache_t* cache) {
+	while (cache->lru_head) {
+		entry_evict(cache, cache->lru_head);
+	}
+	pthread_mutex_destroy(&cache->lock);
+}
+
+bool lftpd_cache_accepts(lftpd_cache_t* cache, const struct stat* st) {
+	return S_ISREG(st->st_mode) && st->st_size > 0 && (size_t) st->st_size <= cache->max_file_size;
+}
+
+lftpd_cache_entry_t* lftpd_cache_get(lftpd_cache_t* cache, const struct stat* st) {
+	long long mtime = cache_mtime(st);
+	long long ctime = cache_ctime(st);
+	unsigned int bucket = cache_bucket(st->st_dev, st->st_ino);
+
+	pthread_mutex_lock(&cache->lock);
+	lftpd_cache_entry_t* entry = cache->buckets[bucket];
+	while (entry && (entry->dev != st->st_dev || entry->ino != st->st_ino)) {
+		entry = entry->bucket_next;
+	}
+	if (entry && (entry->mtime != mtime || entry->ctime != ctime || entry->size != st->st_size)) {
+		// the file has changed since it was cached
+		entry_evict(cache, entry);
+		entry = NULL;
+	}
+	if (entry) {
+		lru_unlink(cache, entry);
+		lru_push(cache, entry);
+		entry->refs++;
+		cache->hits++;
+	}
+	else {
+		cache->misses++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return entry;
+}
+
+lftpd_cache_entry_t* lftpd_cache_put(lftpd_cache_t* cache, const struct stat* st, unsigned char* data) {
+	if (!lftpd_cache_accepts(cache, st)) {
+		return NULL;
+	}
+	lftpd_cache_entry_t* entry = calloc(1, sizeof(lftpd_cache_entry_t));
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->mtime = cache_mtime(st);
+	entry->ctime = cache_ctime(st);
+	entry->size = st->st_size;
+	entry->data = data;
+	entry->refs = 1;
+	entry->linked = true;
+	unsigned int bucket = cache_bucket(entry->dev, entry->ino);
+
+	pthread_mutex_lock(&cache->lock);
+	// another session may have filled the same file meanwhile
+	for (lftpd_cache_entry_t* e = cache->buckets[bucket]; e; e = e->bucket_next) {
+		if (e->dev == entry->dev && e->ino == entry->ino) {
+			entry_evict(cache, e);
+			break;
+		}
+	}
+	while (cache->lru_tail && cache->used + entry->size > cache->capacity) {
+		entry_evict(cache, cache->lru_tail);
+	}
+	entry->bucket_next = cache->buckets[bucket];
+	cache->buckets[bucket] = entry;
+	lru_push(cache, entry);
+	cache->used += entry->size;
+	pthread_mutex_unlock(&cache->lock);
+	return entry;
+}
+
+void lftpd_cache_release(lftpd_cache_t* cache, lftpd_cache_entry_t* entry) {
+	pthread_mutex_lock(&cache->lock);
+	entry->refs--;
+	bool release = entry->refs == 0 && !entry->linked;
+	pthread_mutex_unlock(&cache->lock);
+	if (release) {
+		entry_free(entry);
+	}
+}
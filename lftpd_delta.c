@@ -0,0 +1,114 @@
+#include "private/lftpd_delta.h"
+
+#include <string.h>
+
+#define ADLER_MOD 65521
+
+// the largest n such that 255n(n+1)/2 + (n+1)(MOD-1) fits in 32 bits,
+// so sums can run that long between reductions
+#define ADLER_NMAX 5552
+
+uint32_t lftpd_delta_adler32(uint32_t adler, const unsigned char* buffer, size_t len) {
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+	while (len > 0) {
+		size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+		len -= n;
+		while (n--) {
+			a += *buffer++;
+			b += a;
+		}
+		a %= ADLER_MOD;
+		b %= ADLER_MOD;
+	}
+	return (b << 16) | a;
+}
+
+uint32_t lftpd_delta_adler32_roll(uint32_t adler, unsigned char out, unsigned char in, size_t block_len) {
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+	a = (a + ADLER_MOD - out + in) % ADLER_MOD;
+	b = (uint32_t) ((b + ADLER_MOD - 1 + a + (uint64_t) (ADLER_MOD - out) * (block_len % ADLER_MOD)) % ADLER_MOD);
+	return (b << 16) | a;
+}
+
+void lftpd_delta_reader_init(lftpd_delta_reader_t* reader, lftpd_delta_copy_t copy,
+		lftpd_delta_data_t data, void* context) {
+	memset(reader, 0, sizeof(lftpd_delta_reader_t));
+	reader->copy = copy;
+	reader->data = data;
+	reader->context = context;
+}
+
+static uint64_t read_be(const unsigned char* p, int len) {
+	uint64_t value = 0;
+	for (int i = 0; i < len; i++) {
+		value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+static size_t header_size(unsigned char type) {
+	switch (type) {
+	case LFTPD_DELTA_COPY:
+		return 13;
+	case LFTPD_DELTA_DATA:
+		return 5;
+	case LFTPD_DELTA_END:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int lftpd_delta_reader_feed(lftpd_delta_reader_t* reader, const unsigned char* buffer, size_t len) {
+	while (len > 0) {
+		if (reader->finished) {
+			return -1;
+		}
+		if (reader->remaining > 0) {
+			size_t n = len < reader->remaining ? len : reader->remaining;
+			if (reader->data(reader->context, buffer, n) != 0) {
+				return -1;
+			}
+			buffer += n;
+			len -= n;
+			reader->remaining -= n;
+			continue;
+		}
+
+		unsigned char type = reader->header_len ? reader->header[0] : buffer[0];
+		size_t size = header_size(type);
+		if (size == 0) {
+			return -1;
+		}
+		size_t n = size - reader->header_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(reader->header + reader->header_len, buffer, n);
+		reader->header_len += n;
+		buffer += n;
+		len -= n;
+		if (reader->header_len < size) {
+			continue;
+		}
+
+		reader->header_len = 0;
+		switch (reader->header[0]) {
+		case LFTPD_DELTA_COPY:
+			if (reader->copy(reader->context, read_be(reader->header + 1, 8),
+					(uint32_t) read_be(reader->header + 9, 4)) != 0) {
+				return -1;
+			}
+			break;
+		case LFTPD_DELTA_DATA:
+			reader->remaining = (uint32_t) read_be(reader->header + 1, 4);
+			break;
+		case LFTPD_DELTA_END:
+			reader->finished = true;
+			break;
+		}
+	}
+	return 0;
+}
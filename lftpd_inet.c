@@ -8,14 +8,19 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "private/lftpd_log.h"
 
-int lftpd_inet_listen(int port) {
+int lftpd_inet_listen(int port, int backlog) {
 	int s = socket(AF_INET6, SOCK_STREAM, 0);
 
 	if (s < 0) {
@@ -23,6 +28,11 @@ int lftpd_inet_listen(int port) {
 	  return -1;
 	}
 
+	// allow a restarted server to rebind while old connections linger
+	// in TIME_WAIT
+	int reuse = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
 	struct sockaddr_in6 server_addr = {
 		   .sin6_family = AF_INET6,
 		   .sin6_addr = in6addr_any,
@@ -32,12 +42,14 @@ int lftpd_inet_listen(int port) {
 	int err = bind(s, (struct sockaddr *) &server_addr, sizeof(server_addr));
 	if (err < 0) {
 	  lftpd_log_error("error binding listener port %d", port);
+	  close(s);
 	  return -1;
 	}
 
-	err = listen(s, 10);
+	err = listen(s, backlog);
 	if (err < 0) {
 	   lftpd_log_error("error listening on socket");
+	   close(s);
 	   return -1;
 	}
 
@@ -55,49 +67,151 @@ int lftpd_inet_get_socket_port(int socket) {
 	return ntohs(data_port_addr.sin6_port);
 }
 
-int lftpd_inet_read_line(int socket, char* buffer, size_t buffer_len) {
-	memset(buffer, 0, buffer_len);
-	int total_read_len = 0;
-	while (total_read_len < buffer_len) {
-		// read up to length - 1 bytes. the - 1 leaves room for the
-		// null terminator.
-		int read_len = read(socket,
-				buffer + total_read_len,
-				buffer_len - total_read_len - 1);
+int lftpd_inet_set_timeout(int socket, int seconds) {
+	if (seconds <= 0) {
+		return 0;
+	}
+	struct timeval tv = {
+			.tv_sec = seconds,
+			.tv_usec = 0,
+	};
+	if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+		return -1;
+	}
+	if (setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int lftpd_inet_set_oob_inline(int socket) {
+	int on = 1;
+	return setsockopt(socket, SOL_SOCKET, SO_OOBINLINE, &on, sizeof(on));
+}
+
+int lftpd_inet_set_nodelay(int socket) {
+	int on = 1;
+	return setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int lftpd_inet_set_nonblocking(int socket, bool nonblocking) {
+	int flags = fcntl(socket, F_GETFL);
+	if (flags < 0) {
+		return -1;
+	}
+	flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	return fcntl(socket, F_SETFL, flags);
+}
+
+int lftpd_inet_accept(int listener_socket, int timeout) {
+	struct pollfd pfd = {
+			.fd = listener_socket,
+			.events = POLLIN,
+	};
+	int err = poll(&pfd, 1, timeout > 0 ? timeout * 1000 : -1);
+	if (err == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	else if (err < 0) {
+		return -1;
+	}
+	return accept(listener_socket, NULL, NULL);
+}
+
+static char* find_line_end(const lftpd_inet_line_buffer_t* input) {
+	for (size_t i = 0; i + 1 < input->len; i++) {
+		if (input->data[i] == '\r' && input->data[i + 1] == '\n') {
+			return (char*) input->data + i;
+		}
+	}
+	return NULL;
+}
+
+bool lftpd_inet_has_line(const lftpd_inet_line_buffer_t* input) {
+	return find_line_end(input) != NULL;
+}
+
+int lftpd_inet_take_line(lftpd_inet_line_buffer_t* input, char* buffer, size_t buffer_len) {
+	char* end = find_line_end(input);
+	if (end == NULL) {
+		// once the buffer is full without an end of line there never
+		// will be one
+		return input->len < sizeof(input->data) ? 1 : -1;
+	}
+	size_t line_len = end - input->data;
+	if (line_len >= buffer_len) {
+		return -1;
+	}
+	memcpy(buffer, input->data, line_len);
+	buffer[line_len] = '\0';
+	// keep whatever the client sent after the line for the next call
+	input->len -= line_len + 2;
+	memmove(input->data, end + 2, input->len);
+	lftpd_log_debug("< '%s'", buffer);
+	return 0;
+}
+
+int lftpd_inet_read_line(int socket, lftpd_inet_line_buffer_t* input, char* buffer, size_t buffer_len, int flags) {
+	int err;
+	while ((err = lftpd_inet_take_line(input, buffer, buffer_len)) == 1) {
+		ssize_t read_len = recv(socket,
+				input->data + input->len,
+				sizeof(input->data) - input->len,
+				flags);
 		if (read_len == 0) {
-			// end of stream - since we didn't find the end of line in
-			// the previous pass we won't find it in this one, so this
-			// is an error.
+			// end of stream in the middle of a line
 			return -1;
 		}
+		else if (read_len < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// the rest of the line hasn't arrived yet
+			return 1;
+		}
 		else if (read_len < 0) {
 			// general error
-			return read_len;
-		}
-		total_read_len += read_len;
-		char* p = strstr(buffer, "\r\n");
-		if (p) {
-			// null terminate the line and return
-			*p = '\0';
-			lftpd_log_debug("< '%s'", buffer);
-			return 0;
+			return -1;
 		}
+		input->len += read_len;
 	}
-	return -1;
+	return err;
 }
 
-int lftpd_inet_write_string(int socket, const char* message) {
-	char* p = (char*) message;
-	int length = strlen(message);
-	while (length) {
-		int write_len = write(socket, p, length);
+int lftpd_inet_write(int socket, const void* buffer, size_t len) {
+	const char* p = buffer;
+	while (len) {
+		ssize_t write_len = write(socket, p, len);
 		if (write_len < 0) {
 			lftpd_log_error("write error");
-			return write_len;
+			return -1;
 		}
 		p += write_len;
-		length -= write_len;
+		len -= write_len;
 	}
-	lftpd_log_debug("> %s", message);
 	return 0;
 }
+
+int lftpd_inet_writev(int socket, struct iovec* iov, int count) {
+	while (count > 0) {
+		ssize_t write_len = writev(socket, iov, count);
+		if (write_len < 0) {
+			lftpd_log_error("write error");
+			return -1;
+		}
+		for (; count > 0 && (size_t) write_len >= iov->iov_len; iov++, count--) {
+			write_len -= iov->iov_len;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*) iov->iov_base + write_len;
+			iov->iov_len -= write_len;
+		}
+	}
+	return 0;
+}
+
+int lftpd_inet_write_string(int socket, const char* message) {
+	int err = lftpd_inet_write(socket, message, strlen(message));
+	if (err == 0) {
+		lftpd_log_debug("> %s", message);
+	}
+	return err;
+}
@@ -78,3 +78,13 @@ char* lftpd_io_canonicalize_path(const char* base, const char* name) {
 	return abs_path;
 }
 
+
+bool lftpd_io_is_zero(const void* buffer, size_t len) {
+	const unsigned char* p = buffer;
+	if (len == 0) {
+		return true;
+	}
+	// compare the buffer with itself shifted by a byte, so the C
+	// library's vectorized memcmp does the scanning
+	return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
@@ -0,0 +1,117 @@
+#include "private/lftpd_md5.h"
+
+#include <string.h>
+
+static const uint32_t K[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned char R[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(lftpd_md5_t* md5, const unsigned char* block) {
+	uint32_t m[16];
+	for (int i = 0; i < 16; i++) {
+		m[i] = (uint32_t) block[i * 4]
+				| ((uint32_t) block[i * 4 + 1] << 8)
+				| ((uint32_t) block[i * 4 + 2] << 16)
+				| ((uint32_t) block[i * 4 + 3] << 24);
+	}
+
+	uint32_t a = md5->state[0];
+	uint32_t b = md5->state[1];
+	uint32_t c = md5->state[2];
+	uint32_t d = md5->state[3];
+	for (int i = 0; i < 64; i++) {
+		uint32_t f;
+		int g;
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		}
+		else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) % 16;
+		}
+		else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) % 16;
+		}
+		else {
+			f = c ^ (b | ~d);
+			g = (7 * i) % 16;
+		}
+		uint32_t tmp = d;
+		d = c;
+		c = b;
+		uint32_t x = a + f + K[i] + m[g];
+		b = b + ((x << R[i]) | (x >> (32 - R[i])));
+		a = tmp;
+	}
+	md5->state[0] += a;
+	md5->state[1] += b;
+	md5->state[2] += c;
+	md5->state[3] += d;
+}
+
+void lftpd_md5_init(lftpd_md5_t* md5) {
+	md5->state[0] = 0x67452301;
+	md5->state[1] = 0xefcdab89;
+	md5->state[2] = 0x98badcfe;
+	md5->state[3] = 0x10325476;
+	md5->length = 0;
+}
+
+void lftpd_md5_update(lftpd_md5_t* md5, const void* data, size_t len) {
+	const unsigned char* p = data;
+	size_t used = md5->length % 64;
+	md5->length += len;
+	if (used) {
+		size_t n = 64 - used;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(md5->buffer + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64) {
+			return;
+		}
+		md5_block(md5, md5->buffer);
+	}
+	while (len >= 64) {
+		md5_block(md5, p);
+		p += 64;
+		len -= 64;
+	}
+	memcpy(md5->buffer, p, len);
+}
+
+void lftpd_md5_final(lftpd_md5_t* md5, unsigned char digest[LFTPD_MD5_DIGEST_SIZE]) {
+	uint64_t bits = md5->length * 8;
+	static const unsigned char padding[64] = { 0x80 };
+	size_t used = md5->length % 64;
+	lftpd_md5_update(md5, padding, used < 56 ? 56 - used : 120 - used);
+	unsigned char length[8];
+	for (int i = 0; i < 8; i++) {
+		length[i] = (unsigned char) (bits >> (8 * i));
+	}
+	lftpd_md5_update(md5, length, 8);
+	for (int i = 0; i < 4; i++) {
+		digest[i * 4] = (unsigned char) md5->state[i];
+		digest[i * 4 + 1] = (unsigned char) (md5->state[i] >> 8);
+		digest[i * 4 + 2] = (unsigned char) (md5->state[i] >> 16);
+		digest[i * 4 + 3] = (unsigned char) (md5->state[i] >> 24);
+	}
+}
@@ -0,0 +1,282 @@
+#include "private/lftpd_tar.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAME_OFFSET 0
+#define NAME_LEN 100
+#define MODE_OFFSET 100
+#define UID_OFFSET 108
+#define GID_OFFSET 116
+#define SIZE_OFFSET 124
+#define MTIME_OFFSET 136
+#define CHKSUM_OFFSET 148
+#define TYPE_OFFSET 156
+#define MAGIC_OFFSET 257
+#define VERSION_OFFSET 263
+#define UNAME_OFFSET 265
+#define GNAME_OFFSET 297
+#define PREFIX_OFFSET 345
+#define PREFIX_LEN 155
+
+static void write_octal(unsigned char* field, size_t len, unsigned long long value) {
+	// len - 1 digits plus a terminator, switching to the GNU base-256
+	// encoding for values too large for octal
+	if (len < 2 || value >> (3 * (len - 1))) {
+		memset(field, 0, len);
+		field[0] = 0x80;
+		for (size_t i = len - 1; i > 0 && value; i--) {
+			field[i] = value & 0xff;
+			value >>= 8;
+		}
+		return;
+	}
+	char tmp[24];
+	snprintf(tmp, sizeof(tmp), "%0*llo", (int) (len - 1), value);
+	memcpy(field, tmp, len);
+}
+
+static unsigned long long read_octal(const unsigned char* field, size_t len) {
+	unsigned long long value = 0;
+	if (field[0] & 0x80) {
+		value = field[0] & 0x7f;
+		for (size_t i = 1; i < len; i++) {
+			value = (value << 8) | field[i];
+		}
+		return value;
+	}
+	size_t i = 0;
+	while (i < len && field[i] == ' ') {
+		i++;
+	}
+	while (i < len && field[i] >= '0' && field[i] <= '7') {
+		value = (value << 3) | (field[i] - '0');
+		i++;
+	}
+	return value;
+}
+
+static unsigned int checksum(const unsigned char* header) {
+	// the checksum field itself counts as spaces
+	unsigned int sum = 0;
+	for (int i = 0; i < LFTPD_TAR_BLOCK_SIZE; i++) {
+		if (i >= CHKSUM_OFFSET && i < CHKSUM_OFFSET + 8) {
+			sum += ' ';
+		}
+		else {
+			sum += header[i];
+		}
+	}
+	return sum;
+}
+
+static void format_header(unsigned char* header, const char* name, size_t name_len,
+		const char* prefix, size_t prefix_len, char type, unsigned long long size,
+		time_t mtime, unsigned int mode) {
+	memset(header, 0, LFTPD_TAR_BLOCK_SIZE);
+	memcpy(header + NAME_OFFSET, name, name_len);
+	memcpy(header + PREFIX_OFFSET, prefix, prefix_len);
+	write_octal(header + MODE_OFFSET, 8, mode & 07777);
+	write_octal(header + UID_OFFSET, 8, 0);
+	write_octal(header + GID_OFFSET, 8, 0);
+	write_octal(header + SIZE_OFFSET, 12, size);
+	write_octal(header + MTIME_OFFSET, 12, mtime < 0 ? 0 : (unsigned long long) mtime);
+	header[TYPE_OFFSET] = type;
+	memcpy(header + MAGIC_OFFSET, "ustar", 6);
+	memcpy(header + VERSION_OFFSET, "00", 2);
+	strcpy((char*) header + UNAME_OFFSET, "owner");
+	strcpy((char*) header + GNAME_OFFSET, "group");
+	char tmp[8];
+	snprintf(tmp, sizeof(tmp), "%06o", checksum(header));
+	memcpy(header + CHKSUM_OFFSET, tmp, 7);
+	header[CHKSUM_OFFSET + 7] = ' ';
+}
+
+size_t lftpd_tar_padding(unsigned long long size) {
+	return (LFTPD_TAR_BLOCK_SIZE - (size % LFTPD_TAR_BLOCK_SIZE)) % LFTPD_TAR_BLOCK_SIZE;
+}
+
+size_t lftpd_tar_header(unsigned char* buffer, size_t buffer_len, const char* name,
+		char type, unsigned long long size, time_t mtime, unsigned int mode) {
+	size_t name_len = strlen(name);
+	if (name_len > LFTPD_TAR_NAME_MAX || buffer_len < LFTPD_TAR_BLOCK_SIZE) {
+		return 0;
+	}
+
+	if (name_len <= NAME_LEN) {
+		format_header(buffer, name, name_len, "", 0, type, size, mtime, mode);
+		return LFTPD_TAR_BLOCK_SIZE;
+	}
+
+	// try to split the name between the prefix and name fields
+	for (size_t i = name_len - 1; i > 0; i--) {
+		if (name[i] != '/') {
+			continue;
+		}
+		if (i > PREFIX_LEN) {
+			continue;
+		}
+		if (name_len - i - 1 > NAME_LEN || name_len - i - 1 == 0) {
+			break;
+		}
+		format_header(buffer, name + i + 1, name_len - i - 1, name, i, type, size, mtime, mode);
+		return LFTPD_TAR_BLOCK_SIZE;
+	}
+
+	// fall back to a GNU long name member holding the full name
+	size_t long_name_size = name_len + 1;
+	size_t total = LFTPD_TAR_BLOCK_SIZE + long_name_size + lftpd_tar_padding(long_name_size) + LFTPD_TAR_BLOCK_SIZE;
+	if (buffer_len < total) {
+		return 0;
+	}
+	unsigned char* p = buffer;
+	format_header(p, "././@LongLink", 13, "", 0, LFTPD_TAR_TYPE_LONG_NAME, long_name_size, 0, 0);
+	p += LFTPD_TAR_BLOCK_SIZE;
+	memset(p, 0, long_name_size + lftpd_tar_padding(long_name_size));
+	memcpy(p, name, name_len);
+	p += long_name_size + lftpd_tar_padding(long_name_size);
+	format_header(p, name, NAME_LEN, "", 0, type, size, mtime, mode);
+	return total;
+}
+
+void lftpd_tar_reader_init(lftpd_tar_reader_t* reader, lftpd_tar_entry_t entry,
+		lftpd_tar_data_t data, void* context) {
+	memset(reader, 0, sizeof(lftpd_tar_reader_t));
+	reader->entry = entry;
+	reader->data = data;
+	reader->context = context;
+}
+
+static int finish_long_name(lftpd_tar_reader_t* reader) {
+	reader->in_long_name = false;
+	reader->has_long_name = true;
+	reader->long_name[reader->long_name_len] = '\0';
+	return 0;
+}
+
+static int parse_header(lftpd_tar_reader_t* reader) {
+	unsigned char* header = reader->header;
+
+	// an all zero block marks the end of the archive
+	bool zero = true;
+	for (int i = 0; i < LFTPD_TAR_BLOCK_SIZE && zero; i++) {
+		zero = header[i] == 0;
+	}
+	if (zero) {
+		reader->finished = true;
+		return 0;
+	}
+
+	if (read_octal(header + CHKSUM_OFFSET, 8) != checksum(header)) {
+		return -1;
+	}
+
+	char type = header[TYPE_OFFSET];
+	unsigned long long size = read_octal(header + SIZE_OFFSET, 12);
+	if (type == LFTPD_TAR_TYPE_LONG_NAME) {
+		if (size > LFTPD_TAR_NAME_MAX + 1) {
+			return -1;
+		}
+		reader->in_long_name = true;
+		reader->long_name_len = 0;
+		reader->remaining = size;
+		reader->padding = lftpd_tar_padding(size);
+		if (size == 0) {
+			return finish_long_name(reader);
+		}
+		return 0;
+	}
+
+	char name[LFTPD_TAR_NAME_MAX + 1];
+	if (reader->has_long_name) {
+		strcpy(name, reader->long_name);
+		reader->has_long_name = false;
+	}
+	else {
+		size_t prefix_len = strnlen((char*) header + PREFIX_OFFSET, PREFIX_LEN);
+		size_t name_len = strnlen((char*) header + NAME_OFFSET, NAME_LEN);
+		char* p = name;
+		if (prefix_len) {
+			memcpy(p, header + PREFIX_OFFSET, prefix_len);
+			p += prefix_len;
+			*p++ = '/';
+		}
+		memcpy(p, header + NAME_OFFSET, name_len);
+		p[name_len] = '\0';
+	}
+
+	// old archives use a trailing slash rather than a type for
+	// directories
+	if (type == '\0') {
+		size_t len = strlen(name);
+		type = (len && name[len - 1] == '/') ? LFTPD_TAR_TYPE_DIRECTORY : LFTPD_TAR_TYPE_FILE;
+	}
+
+	reader->remaining = size;
+	reader->padding = lftpd_tar_padding(size);
+	time_t mtime = (time_t) read_octal(header + MTIME_OFFSET, 12);
+	return reader->entry(reader->context, name, type, size, mtime);
+}
+
+int lftpd_tar_reader_feed(lftpd_tar_reader_t* reader, const unsigned char* buffer, size_t len) {
+	while (len > 0 && !reader->finished) {
+		if (reader->remaining > 0) {
+			size_t n = len;
+			if (n > reader->remaining) {
+				n = reader->remaining;
+			}
+			if (reader->in_long_name) {
+				if (reader->long_name_len + n > LFTPD_TAR_NAME_MAX + 1) {
+					return -1;
+				}
+				memcpy(reader->long_name + reader->long_name_len, buffer, n);
+				reader->long_name_len += n;
+			}
+			else if (reader->data(reader->context, buffer, n) != 0) {
+				return -1;
+			}
+			buffer += n;
+			len -= n;
+			reader->remaining -= n;
+			if (reader->remaining == 0 && reader->in_long_name) {
+				// the stored name includes its terminator
+				if (reader->long_name_len > 0 && reader->long_name[reader->long_name_len - 1] == '\0') {
+					reader->long_name_len--;
+				}
+				finish_long_name(reader);
+			}
+		}
+		else if (reader->padding > 0) {
+			size_t n = len;
+			if (n > reader->padding) {
+				n = reader->padding;
+			}
+			buffer += n;
+			len -= n;
+			reader->padding -= n;
+		}
+		else {
+			size_t n = LFTPD_TAR_BLOCK_SIZE - reader->header_len;
+			if (n > len) {
+				n = len;
+			}
+			memcpy(reader->header + reader->header_len, buffer, n);
+			reader->header_len += n;
+			buffer += n;
+			len -= n;
+			if (reader->header_len == LFTPD_TAR_BLOCK_SIZE) {
+				reader->header_len = 0;
+				if (parse_header(reader) != 0) {
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+bool lftpd_tar_reader_complete(lftpd_tar_reader_t* reader) {
+	return reader->finished || (!reader->in_long_name && !reader->has_long_name
+			&& reader->remaining == 0 && reader->padding == 0 && reader->header_len == 0);
+}
@@ -0,0 +1,146 @@
+#include "private/lftpd_tls.h"
+#include "private/lftpd_log.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct lftpd_tls_context {
+	SSL_CTX* ctx;
+};
+
+struct lftpd_tls {
+	SSL* ssl;
+};
+
+static void log_errors(const char* message) {
+	char error[256];
+	unsigned long code;
+	while ((code = ERR_get_error()) != 0) {
+		ERR_error_string_n(code, error, sizeof(error));
+		lftpd_log_error("%s: %s", message, error);
+	}
+}
+
+lftpd_tls_context_t* lftpd_tls_context_create(const char* certificate_file, const char* key_file) {
+	lftpd_tls_context_t* context = calloc(1, sizeof(lftpd_tls_context_t));
+	if (context == NULL) {
+		return NULL;
+	}
+	context->ctx = SSL_CTX_new(TLS_server_method());
+	if (context->ctx == NULL) {
+		goto error;
+	}
+	SSL_CTX_set_min_proto_version(context->ctx, TLS1_2_VERSION);
+
+	// hand the symmetric crypto to the kernel after the handshake where
+	// it is supported, so sendfile() keeps working on secured sockets.
+	// Clients often drop data connections without close_notify, which
+	// is harmless since FTP already reports the transfer result.
+	SSL_CTX_set_options(context->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+	// data connections may resume the control connection's session
+	static const unsigned char session_id_context[] = "lftpd";
+	SSL_CTX_set_session_id_context(context->ctx, session_id_context, sizeof(session_id_context) - 1);
+
+	if (SSL_CTX_use_certificate_chain_file(context->ctx, certificate_file) != 1
+			|| SSL_CTX_use_PrivateKey_file(context->ctx, key_file, SSL_FILETYPE_PEM) != 1
+			|| SSL_CTX_check_private_key(context->ctx) != 1) {
+		goto error;
+	}
+	return context;
+
+	error:
+	log_errors("error loading TLS certificate");
+	lftpd_tls_context_destroy(context);
+	return NULL;
+}
+
+void lftpd_tls_context_destroy(lftpd_tls_context_t* context) {
+	if (context == NULL) {
+		return;
+	}
+	SSL_CTX_free(context->ctx);
+	free(context);
+}
+
+lftpd_tls_t* lftpd_tls_accept(lftpd_tls_context_t* context, int socket) {
+	lftpd_tls_t* tls = calloc(1, sizeof(lftpd_tls_t));
+	if (tls == NULL) {
+		return NULL;
+	}
+	tls->ssl = SSL_new(context->ctx);
+	if (tls->ssl == NULL || SSL_set_fd(tls->ssl, socket) != 1) {
+		goto error;
+	}
+	if (SSL_accept(tls->ssl) != 1) {
+		goto error;
+	}
+	lftpd_log_debug("TLS handshake complete, %s, kernel send %d, kernel receive %d",
+			SSL_get_cipher_name(tls->ssl), lftpd_tls_kernel_send(tls), lftpd_tls_kernel_receive(tls));
+	return tls;
+
+	error:
+	log_errors("TLS handshake failed");
+	SSL_free(tls->ssl);
+	free(tls);
+	return NULL;
+}
+
+ssize_t lftpd_tls_read(lftpd_tls_t* tls, void* buffer, size_t len) {
+	int read_len = SSL_read(tls->ssl, buffer, len > INT_MAX ? INT_MAX : (int) len);
+	if (read_len > 0) {
+		return read_len;
+	}
+	int error = SSL_get_error(tls->ssl, read_len);
+	if (error == SSL_ERROR_ZERO_RETURN) {
+		return 0;
+	}
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+		// a non-blocking socket without a whole record yet
+		errno = EAGAIN;
+		return -1;
+	}
+	log_errors("TLS read error");
+	return -1;
+}
+
+size_t lftpd_tls_pending(lftpd_tls_t* tls) {
+	return SSL_pending(tls->ssl);
+}
+
+int lftpd_tls_write(lftpd_tls_t* tls, const void* buffer, size_t len) {
+	const char* p = buffer;
+	while (len) {
+		int write_len = SSL_write(tls->ssl, p, len > INT_MAX ? INT_MAX : (int) len);
+		if (write_len <= 0) {
+			log_errors("TLS write error");
+			return -1;
+		}
+		p += write_len;
+		len -= write_len;
+	}
+	return 0;
+}
+
+bool lftpd_tls_kernel_send(lftpd_tls_t* tls) {
+	return BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) > 0;
+}
+
+bool lftpd_tls_kernel_receive(lftpd_tls_t* tls) {
+	return BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) > 0;
+}
+
+void lftpd_tls_close(lftpd_tls_t* tls) {
+	if (tls == NULL) {
+		return;
+	}
+	// only send our close_notify, don't wait for the peer's
+	SSL_shutdown(tls->ssl);
+	SSL_free(tls->ssl);
+	free(tls);
+}
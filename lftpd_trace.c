@@ -0,0 +1,215 @@
+#include "private/lftpd_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+	// odd while the slot is being written, 2 * index + 2 once the
+	// event with that index is complete
+	uint64_t seq;
+	const char* name;
+	uint64_t start;
+	uint64_t duration;
+	uint32_t tid;
+	char arg[LFTPD_TRACE_ARG_MAX];
+} trace_event_t;
+
+struct lftpd_trace_buffer {
+	// only the attached thread writes head and events, the dump reads
+	// them without taking a lock
+	uint64_t head;
+	size_t capacity;
+	uint32_t tid;
+	bool attached;
+	struct lftpd_trace_buffer* next;
+	trace_event_t events[];
+};
+
+struct lftpd_trace {
+	pthread_mutex_t lock;
+	size_t capacity;
+	uint32_t next_tid;
+	lftpd_trace_buffer_t* buffers;
+};
+
+lftpd_trace_t* lftpd_trace_create(size_t events_per_thread) {
+	if (events_per_thread == 0) {
+		return NULL;
+	}
+	lftpd_trace_t* trace = calloc(1, sizeof(lftpd_trace_t));
+	if (trace == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&trace->lock, NULL);
+	trace->capacity = events_per_thread;
+	return trace;
+}
+
+void lftpd_trace_destroy(lftpd_trace_t* trace) {
+	if (trace == NULL) {
+		return;
+	}
+	lftpd_trace_buffer_t* buffer = trace->buffers;
+	while (buffer) {
+		lftpd_trace_buffer_t* next = buffer->next;
+		free(buffer);
+		buffer = next;
+	}
+	pthread_mutex_destroy(&trace->lock);
+	free(trace);
+}
+
+lftpd_trace_buffer_t* lftpd_trace_attach(lftpd_trace_t* trace) {
+	pthread_mutex_lock(&trace->lock);
+	lftpd_trace_buffer_t* buffer = trace->buffers;
+	while (buffer && buffer->attached) {
+		buffer = buffer->next;
+	}
+	if (buffer == NULL) {
+		buffer = calloc(1, sizeof(lftpd_trace_buffer_t) + trace->capacity * sizeof(trace_event_t));
+		if (buffer == NULL) {
+			pthread_mutex_unlock(&trace->lock);
+			return NULL;
+		}
+		buffer->capacity = trace->capacity;
+		buffer->next = trace->buffers;
+		trace->buffers = buffer;
+	}
+	buffer->attached = true;
+	// events keep the tid they were recorded with, so spans left by the
+	// previous session stay apart from the new one
+	buffer->tid = ++trace->next_tid;
+	pthread_mutex_unlock(&trace->lock);
+	return buffer;
+}
+
+void lftpd_trace_detach(lftpd_trace_t* trace, lftpd_trace_buffer_t* buffer) {
+	pthread_mutex_lock(&trace->lock);
+	buffer->attached = false;
+	pthread_mutex_unlock(&trace->lock);
+}
+
+uint64_t lftpd_trace_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void lftpd_trace_span(lftpd_trace_buffer_t* buffer, const char* name, const char* arg, uint64_t start) {
+	uint64_t end = lftpd_trace_now();
+	uint64_t index = buffer->head;
+	trace_event_t* event = &buffer->events[index % buffer->capacity];
+
+	// a seqlock per slot: a reader that sees the same even sequence
+	// before and after copying the slot got a whole event
+	__atomic_store_n(&event->seq, index * 2 + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&event->name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->start, start, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->duration, end > start ? end - start : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->tid, buffer->tid, __ATOMIC_RELAXED);
+	size_t i = 0;
+	if (arg) {
+		for (; i < LFTPD_TRACE_ARG_MAX - 1 && arg[i]; i++) {
+			__atomic_store_n(&event->arg[i], arg[i], __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&event->arg[i], '\0', __ATOMIC_RELAXED);
+	__atomic_store_n(&event->seq, index * 2 + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&buffer->head, index + 1, __ATOMIC_RELEASE);
+}
+
+static bool read_event(trace_event_t* event, uint64_t index, trace_event_t* copy) {
+	uint64_t seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+	if (seq != index * 2 + 2) {
+		return false;
+	}
+	copy->name = __atomic_load_n(&event->name, __ATOMIC_RELAXED);
+	copy->start = __atomic_load_n(&event->start, __ATOMIC_RELAXED);
+	copy->duration = __atomic_load_n(&event->duration, __ATOMIC_RELAXED);
+	copy->tid = __atomic_load_n(&event->tid, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < LFTPD_TRACE_ARG_MAX; i++) {
+		copy->arg[i] = __atomic_load_n(&event->arg[i], __ATOMIC_RELAXED);
+	}
+	copy->arg[LFTPD_TRACE_ARG_MAX - 1] = '\0';
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static size_t json_escape(char* out, size_t out_len, const char* s) {
+	size_t n = 0;
+	for (; *s && n + 7 < out_len; s++) {
+		unsigned char c = (unsigned char) *s;
+		if (c == '"' || c == '\\') {
+			out[n++] = '\\';
+			out[n++] = c;
+		}
+		else if (c < 0x20) {
+			n += snprintf(out + n, out_len - n, "\\u%04x", c);
+		}
+		else {
+			out[n++] = c;
+		}
+	}
+	out[n] = '\0';
+	return n;
+}
+
+static int write_event(const trace_event_t* event, bool first, lftpd_trace_writer_t writer, void* context) {
+	char name[LFTPD_TRACE_ARG_MAX * 6];
+	char arg[LFTPD_TRACE_ARG_MAX * 6];
+	char line[sizeof(name) + sizeof(arg) + 160];
+	json_escape(name, sizeof(name), event->name ? event->name : "");
+	json_escape(arg, sizeof(arg), event->arg);
+	// Chrome wants microseconds, keep the nanoseconds as decimals
+	int len = snprintf(line, sizeof(line),
+			"%s\n{\"name\":\"%s\",\"cat\":\"lftpd\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+			"\"ts\":%llu.%03llu,\"dur\":%llu.%03llu",
+			first ? "" : ",", name, event->tid,
+			(unsigned long long) (event->start / 1000), (unsigned long long) (event->start % 1000),
+			(unsigned long long) (event->duration / 1000), (unsigned long long) (event->duration % 1000));
+	if (event->arg[0]) {
+		len += snprintf(line + len, sizeof(line) - len, ",\"args\":{\"arg\":\"%s\"}", arg);
+	}
+	len += snprintf(line + len, sizeof(line) - len, "}");
+	return writer(context, line, len);
+}
+
+int lftpd_trace_dump(lftpd_trace_t* trace, lftpd_trace_writer_t writer, void* context) {
+	static const char header[] = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	static const char footer[] = "\n]}\n";
+	if (writer(context, header, sizeof(header) - 1) != 0) {
+		return -1;
+	}
+
+	// buffers are only ever added at the head and freed with the
+	// tracer, so the list can be walked without the lock while sessions
+	// come and go, and keep recording
+	pthread_mutex_lock(&trace->lock);
+	lftpd_trace_buffer_t* buffers = trace->buffers;
+	pthread_mutex_unlock(&trace->lock);
+
+	int err = 0;
+	bool first = true;
+	for (lftpd_trace_buffer_t* buffer = buffers; buffer && err == 0; buffer = buffer->next) {
+		uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+		uint64_t index = head > buffer->capacity ? head - buffer->capacity : 0;
+		for (; index < head && err == 0; index++) {
+			trace_event_t event;
+			if (!read_event(&buffer->events[index % buffer->capacity], index, &event)) {
+				continue;
+			}
+			err = write_event(&event, first, writer, context);
+			first = false;
+		}
+	}
+
+	if (err == 0) {
+		err = writer(context, footer, sizeof(footer) - 1);
+	}
+	return err == 0 ? 0 : -1;
+}
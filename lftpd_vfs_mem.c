@@ -0,0 +1,656 @@
+#include "lftpd_vfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// An in-memory file system. File contents live in reference counted
+// blobs. A reader takes a reference to the current blob when it opens
+// the file, and a writer fills a private blob that replaces the current
+// one when it closes. Readers therefore never see a partial upload and
+// can read without holding the lock.
+
+#define MEM_DEV 0x6d656d
+
+typedef struct {
+	int refs;
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+} mem_blob_t;
+
+typedef struct mem_node {
+	char* name;
+	bool is_dir;
+	ino_t ino;
+	time_t mtime;
+	// changes whenever the contents or mtime do, like a real ctime, so
+	// anything keyed on it notices a rewrite that restores the mtime
+	struct timespec ctime;
+	mem_blob_t* blob;
+	// one reference for being linked into the tree plus one for each
+	// writer
+	int refs;
+	struct mem_node* parent;
+	struct mem_node* children;
+	struct mem_node* next;
+} mem_node_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	mem_node_t* root;
+	ino_t next_ino;
+} mem_fs_t;
+
+typedef struct {
+	mem_node_t* node;
+	mem_blob_t* blob;
+	off_t offset;
+	bool writing;
+} mem_file_t;
+
+typedef struct {
+	char** names;
+	int count;
+	int index;
+} mem_dir_t;
+
+static mem_blob_t* blob_create(const void* data, size_t len) {
+	mem_blob_t* blob = calloc(1, sizeof(mem_blob_t));
+	if (blob == NULL) {
+		return NULL;
+	}
+	blob->refs = 1;
+	if (len > 0) {
+		blob->data = malloc(len);
+		if (blob->data == NULL) {
+			free(blob);
+			return NULL;
+		}
+		memcpy(blob->data, data, len);
+		blob->size = len;
+		blob->capacity = len;
+	}
+	return blob;
+}
+
+// must be called with the lock held
+static void blob_release(mem_blob_t* blob) {
+	if (blob == NULL || --blob->refs > 0) {
+		return;
+	}
+	free(blob->data);
+	free(blob);
+}
+
+static void node_touch(mem_node_t* node) {
+	clock_gettime(CLOCK_REALTIME, &node->ctime);
+	node->mtime = node->ctime.tv_sec;
+}
+
+static mem_node_t* node_create(mem_fs_t* fs, const char* name, bool is_dir) {
+	mem_node_t* node = calloc(1, sizeof(mem_node_t));
+	if (node == NULL) {
+		return NULL;
+	}
+	node->name = strdup(name);
+	if (node->name == NULL) {
+		free(node);
+		return NULL;
+	}
+	node->is_dir = is_dir;
+	node->ino = ++fs->next_ino;
+	node_touch(node);
+	node->refs = 1;
+	return node;
+}
+
+// must be called with the lock held
+static void node_release(mem_node_t* node) {
+	if (--node->refs > 0) {
+		return;
+	}
+	mem_node_t* child = node->children;
+	while (child) {
+		mem_node_t* next = child->next;
+		node_release(child);
+		child = next;
+	}
+	blob_release(node->blob);
+	free(node->name);
+	free(node);
+}
+
+static void node_attach(mem_node_t* parent, mem_node_t* node) {
+	node->parent = parent;
+	node->next = parent->children;
+	parent->children = node;
+	node_touch(parent);
+}
+
+static void node_detach(mem_node_t* node) {
+	mem_node_t* parent = node->parent;
+	for (mem_node_t** p = &parent->children; *p; p = &(*p)->next) {
+		if (*p == node) {
+			*p = node->next;
+			break;
+		}
+	}
+	node->parent = NULL;
+	node->next = NULL;
+	node_touch(parent);
+}
+
+static mem_node_t* node_child(mem_node_t* dir, const char* name, size_t name_len) {
+	for (mem_node_t* child = dir->children; child; child = child->next) {
+		if (strlen(child->name) == name_len && strncmp(child->name, name, name_len) == 0) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Walk path and return the node it names, or NULL. If parent is
+ * not NULL it receives the directory that would contain the final
+ * segment and name receives that segment, so callers can create it.
+ * Must be called with the lock held.
+ */
+static mem_node_t* node_lookup(mem_fs_t* fs, const char* path, mem_node_t** parent, const char** name) {
+	mem_node_t* dir = NULL;
+	mem_node_t* node = fs->root;
+	const char* segment = "";
+	const char* p = path;
+	while (*p) {
+		while (*p == '/') {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		const char* end = strchr(p, '/');
+		size_t len = end ? (size_t) (end - p) : strlen(p);
+		if (node == NULL || !node->is_dir) {
+			// an intermediate segment is missing or not a directory
+			dir = NULL;
+			node = NULL;
+			break;
+		}
+		dir = node;
+		segment = p;
+		node = node_child(dir, p, len);
+		p += len;
+	}
+	if (parent) {
+		*parent = (dir && strchr(segment, '/') == NULL) ? dir : NULL;
+		if (name) {
+			*name = segment;
+		}
+	}
+	return node;
+}
+
+static void* mem_open(lftpd_vfs_t* vfs, const char* path, lftpd_vfs_mode_t mode) {
+	mem_fs_t* fs = vfs->context;
+	mem_file_t* file = calloc(1, sizeof(mem_file_t));
+	if (file == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&fs->lock);
+	mem_node_t* parent = NULL;
+	const char* name = NULL;
+	mem_node_t* node = node_lookup(fs, path, &parent, &name);
+	if (node != NULL && node->is_dir) {
+		errno = EISDIR;
+		goto error;
+	}
+
+	if (mode == LFTPD_VFS_READ) {
+		if (node == NULL) {
+			errno = ENOENT;
+			goto error;
+		}
+		file->blob = node->blob;
+		if (file->blob) {
+			file->blob->refs++;
+		}
+	}
+	else {
+		if (node == NULL) {
+			if (parent == NULL || *name == '\0') {
+				errno = ENOENT;
+				goto error;
+			}
+			node = node_create(fs, name, false);
+			if (node == NULL) {
+				errno = ENOMEM;
+				goto error;
+			}
+			node_attach(parent, node);
+		}
+		file->blob = blob_create(NULL, 0);
+		if (file->blob == NULL) {
+			errno = ENOMEM;
+			goto error;
+		}
+		node->refs++;
+		file->node = node;
+		file->writing = true;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return file;
+
+	error:
+	pthread_mutex_unlock(&fs->lock);
+	free(file);
+	return NULL;
+}
+
+static ssize_t mem_read(lftpd_vfs_t* vfs, void* handle, void* buffer, size_t len) {
+	mem_file_t* file = handle;
+	mem_blob_t* blob = file->blob;
+	if (blob == NULL || file->offset >= (off_t) blob->size) {
+		return 0;
+	}
+	size_t available = blob->size - file->offset;
+	if (len > available) {
+		len = available;
+	}
+	memcpy(buffer, blob->data + file->offset, len);
+	file->offset += len;
+	return len;
+}
+
+static ssize_t mem_write(lftpd_vfs_t* vfs, void* handle, const void* buffer, size_t len) {
+	mem_file_t* file = handle;
+	if (!file->writing) {
+		errno = EBADF;
+		return -1;
+	}
+	mem_blob_t* blob = file->blob;
+	size_t end = file->offset + len;
+	if (end > blob->capacity) {
+		size_t capacity = blob->capacity ? blob->capacity : 4096;
+		while (capacity < end) {
+			capacity *= 2;
+		}
+		unsigned char* data = realloc(blob->data, capacity);
+		if (data == NULL) {
+			errno = ENOSPC;
+			return -1;
+		}
+		blob->data = data;
+		blob->capacity = capacity;
+	}
+	// a seek past the end leaves a hole that reads back as zeros
+	if ((size_t) file->offset > blob->size) {
+		memset(blob->data + blob->size, 0, file->offset - blob->size);
+	}
+	memcpy(blob->data + file->offset, buffer, len);
+	file->offset += len;
+	if (end > blob->size) {
+		blob->size = end;
+	}
+	return len;
+}
+
+static off_t mem_seek(lftpd_vfs_t* vfs, void* handle, off_t offset, int whence) {
+	mem_file_t* file = handle;
+	off_t size = file->blob ? file->blob->size : 0;
+	off_t position;
+	switch (whence) {
+	case SEEK_SET:
+		position = offset;
+		break;
+	case SEEK_CUR:
+		position = file->offset + offset;
+		break;
+	case SEEK_END:
+		position = size + offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (position < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	file->offset = position;
+	return position;
+}
+
+static int mem_close(lftpd_vfs_t* vfs, void* handle) {
+	mem_fs_t* fs = vfs->context;
+	mem_file_t* file = handle;
+	pthread_mutex_lock(&fs->lock);
+	if (file->writing) {
+		// publish the new contents
+		mem_blob_t* old = file->node->blob;
+		file->node->blob = file->blob;
+		node_touch(file->node);
+		blob_release(old);
+		node_release(file->node);
+	}
+	else {
+		blob_release(file->blob);
+	}
+	pthread_mutex_unlock(&fs->lock);
+	free(file);
+	return 0;
+}
+
+static int mem_stat(lftpd_vfs_t* vfs, const char* path, struct stat* st) {
+	mem_fs_t* fs = vfs->context;
+	pthread_mutex_lock(&fs->lock);
+	mem_node_t* node = node_lookup(fs, path, NULL, NULL);
+	if (node == NULL) {
+		pthread_mutex_unlock(&fs->lock);
+		errno = ENOENT;
+		return -1;
+	}
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = MEM_DEV;
+	st->st_ino = node->ino;
+	st->st_mode = node->is_dir ? (S_IFDIR | 0777) : (S_IFREG | 0666);
+	st->st_nlink = 1;
+	st->st_size = node->blob ? node->blob->size : 0;
+	st->st_mtime = node->mtime;
+	st->st_atime = node->mtime;
+	st->st_ctim = node->ctime;
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+
+static void* mem_opendir(lftpd_vfs_t* vfs, const char* path) {
+	mem_fs_t* fs = vfs->context;
+	pthread_mutex_lock(&fs->lock);
+	mem_node_t* node = node_lookup(fs, path, NULL, NULL);
+	if (node == NULL || !node->is_dir) {
+		pthread_mutex_unlock(&fs->lock);
+		errno = node ? ENOTDIR : ENOENT;
+		return NULL;
+	}
+
+	// snapshot the names so the listing isn't disturbed by changes
+	// made while it is being read
+	mem_dir_t* dir = calloc(1, sizeof(mem_dir_t));
+	if (dir == NULL) {
+		pthread_mutex_unlock(&fs->lock);
+		return NULL;
+	}
+	for (mem_node_t* child = node->children; child; child = child->next) {
+		dir->count++;
+	}
+	dir->names = calloc(dir->count + 1, sizeof(char*));
+	int i = 0;
+	for (mem_node_t* child = node->children; child && dir->names; child = child->next) {
+		dir->names[i++] = strdup(child->name);
+	}
+	pthread_mutex_unlock(&fs->lock);
+	if (dir->names == NULL) {
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+static const char* mem_readdir(lftpd_vfs_t* vfs, void* handle) {
+	mem_dir_t* dir = handle;
+	while (dir->index < dir->count) {
+		const char* name = dir->names[dir->index++];
+		if (name) {
+			return name;
+		}
+	}
+	return NULL;
+}
+
+static int mem_closedir(lftpd_vfs_t* vfs, void* handle) {
+	mem_dir_t* dir = handle;
+	for (int i = 0; i < dir->count; i++) {
+		free(dir->names[i]);
+	}
+	free(dir->names);
+	free(dir);
+	return 0;
+}
+
+static int mem_unlink(lftpd_vfs_t* vfs, const char* path) {
+	mem_fs_t* fs = vfs->context;
+	pthread_mutex_lock(&fs->lock);
+	mem_node_t* node = node_lookup(fs, path, NULL, NULL);
+	int err = -1;
+	if (node == NULL) {
+		errno = ENOENT;
+	}
+	else if (node == fs->root || node->children) {
+		errno = ENOTEMPTY;
+	}
+	else {
+		node_detach(node);
+		node_release(node);
+		err = 0;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return err;
+}
+
+static int mem_mkdir(lftpd_vfs_t* vfs, const char* path) {
+	mem_fs_t* fs = vfs->context;
+	pthread_mutex_lock(&fs->lock);
+	mem_node_t* parent = NULL;
+	const char* name = NULL;
+	mem_node_t* node = node_lookup(fs, path, &parent, &name);
+	int err = -1;
+	if (node != NULL) {
+		errno = EEXIST;
+	}
+	else if (parent == NULL || *name == '\0') {
+		errno = ENOENT;
+	}
+	else if ((node = node_create(fs, name, true)) == NULL) {
+		errno = ENOMEM;
+	}
+	else {
+		node_attach(parent, node);
+		err = 0;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return err;
+}
+
+static int mem_rename(lftpd_vfs_t* vfs, const char* from, const char* to) {
+	mem_fs_t* fs = vfs->context;
+	pthread_mutex_lock(&fs->lock);
+	int err = -1;
+	mem_node_t* node = node_lookup(fs, from, NULL, NULL);
+	mem_node_t* parent = NULL;
+	const char* name = NULL;
+	mem_node_t* target = node_lookup(fs, to, &parent, &name);
+	if (node == NULL || node == fs->root || parent == NULL || *name == '\0') {
+		errno = ENOENT;
+		goto done;
+	}
+	if (target == node) {
+		err = 0;
+		goto done;
+	}
+	// a directory can't be moved inside itself
+	for (mem_node_t* p = parent; p; p = p->parent) {
+		if (p == node) {
+			errno = EINVAL;
+			goto done;
+		}
+	}
+	if (target != NULL) {
+		if (target->is_dir || node->is_dir) {
+			errno = EEXIST;
+			goto done;
+		}
+		node_detach(target);
+		node_release(target);
+	}
+	char* new_name = strdup(name);
+	if (new_name == NULL) {
+		errno = ENOMEM;
+		goto done;
+	}
+	node_detach(node);
+	free(node->name);
+	node->name = new_name;
+	node_attach(parent, node);
+	err = 0;
+
+	done:
+	pthread_mutex_unlock(&fs->lock);
+	return err;
+}
+
+static int mem_utime(lftpd_vfs_t* vfs, const char* path, time_t mtime) {
+	mem_fs_t* fs = vfs->context;
+	pthread_mutex_lock(&fs->lock);
+	mem_node_t* node = node_lookup(fs, path, NULL, NULL);
+	if (node == NULL) {
+		pthread_mutex_unlock(&fs->lock);
+		errno = ENOENT;
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &node->ctime);
+	node->mtime = mtime;
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+
+static ssize_t mem_sendfile(lftpd_vfs_t* vfs, void* handle, int socket, off_t* offset, size_t count) {
+	// the blob can't change while we hold a reference, so write straight
+	// from it with no intermediate copy
+	mem_file_t* file = handle;
+	mem_blob_t* blob = file->blob;
+	if (blob == NULL || *offset >= (off_t) blob->size) {
+		return 0;
+	}
+	size_t available = blob->size - *offset;
+	if (count > available) {
+		count = available;
+	}
+	ssize_t written = write(socket, blob->data + *offset, count);
+	if (written > 0) {
+		*offset += written;
+	}
+	return written;
+}
+
+int lftpd_vfs_mem_init(lftpd_vfs_t* vfs) {
+	memset(vfs, 0, sizeof(lftpd_vfs_t));
+	mem_fs_t* fs = calloc(1, sizeof(mem_fs_t));
+	if (fs == NULL) {
+		return -1;
+	}
+	fs->root = node_create(fs, "", true);
+	if (fs->root == NULL) {
+		free(fs);
+		return -1;
+	}
+	pthread_mutex_init(&fs->lock, NULL);
+
+	vfs->context = fs;
+	vfs->open = mem_open;
+	vfs->read = mem_read;
+	vfs->write = mem_write;
+	vfs->seek = mem_seek;
+	vfs->close = mem_close;
+	vfs->stat = mem_stat;
+	vfs->opendir = mem_opendir;
+	vfs->readdir = mem_readdir;
+	vfs->closedir = mem_closedir;
+	vfs->unlink = mem_unlink;
+	vfs->mkdir = mem_mkdir;
+	vfs->rename = mem_rename;
+	vfs->utime = mem_utime;
+	vfs->sendfile = mem_sendfile;
+	return 0;
+}
+
+void lftpd_vfs_mem_destroy(lftpd_vfs_t* vfs) {
+	mem_fs_t* fs = vfs->context;
+	if (fs == NULL) {
+		return;
+	}
+	node_release(fs->root);
+	pthread_mutex_destroy(&fs->lock);
+	free(fs);
+	vfs->context = NULL;
+}
+
+int lftpd_vfs_mem_add_file(lftpd_vfs_t* vfs, const char* path, const void* data, size_t len) {
+	mem_fs_t* fs = vfs->context;
+	mem_blob_t* blob = blob_create(data, len);
+	if (blob == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->lock);
+	int err = -1;
+
+	// create any missing parent directories
+	mem_node_t* dir = fs->root;
+	const char* p = path;
+	while (true) {
+		while (*p == '/') {
+			p++;
+		}
+		const char* end = strchr(p, '/');
+		if (end == NULL) {
+			break;
+		}
+		mem_node_t* child = node_child(dir, p, end - p);
+		if (child == NULL) {
+			char* name = strndup(p, end - p);
+			child = name ? node_create(fs, name, true) : NULL;
+			free(name);
+			if (child == NULL) {
+				goto done;
+			}
+			node_attach(dir, child);
+		}
+		else if (!child->is_dir) {
+			goto done;
+		}
+		dir = child;
+		p = end;
+	}
+	if (*p == '\0') {
+		goto done;
+	}
+
+	mem_node_t* node = node_child(dir, p, strlen(p));
+	if (node == NULL) {
+		node = node_create(fs, p, false);
+		if (node == NULL) {
+			goto done;
+		}
+		node_attach(dir, node);
+	}
+	else if (node->is_dir) {
+		goto done;
+	}
+	blob_release(node->blob);
+	node->blob = blob;
+	node_touch(node);
+	blob = NULL;
+	err = 0;
+
+	done:
+	blob_release(blob);
+	pthread_mutex_unlock(&fs->lock);
+	return err;
+}
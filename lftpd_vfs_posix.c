@@ -0,0 +1,158 @@
+// for copy_file_range()
+#define _GNU_SOURCE
+
+#include "lftpd_vfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#endif
+
+typedef struct {
+	int fd;
+} posix_file_t;
+
+static void* posix_open(lftpd_vfs_t* vfs, const char* path, lftpd_vfs_mode_t mode) {
+	int flags = O_RDONLY;
+	if (mode == LFTPD_VFS_WRITE) {
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+	}
+	int fd = open(path, flags, 0666);
+	if (fd < 0) {
+		return NULL;
+	}
+	posix_file_t* file = malloc(sizeof(posix_file_t));
+	if (file == NULL) {
+		close(fd);
+		return NULL;
+	}
+	file->fd = fd;
+	return file;
+}
+
+static ssize_t posix_read(lftpd_vfs_t* vfs, void* file, void* buffer, size_t len) {
+	return read(((posix_file_t*) file)->fd, buffer, len);
+}
+
+static ssize_t posix_write(lftpd_vfs_t* vfs, void* file, const void* buffer, size_t len) {
+	return write(((posix_file_t*) file)->fd, buffer, len);
+}
+
+static off_t posix_seek(lftpd_vfs_t* vfs, void* file, off_t offset, int whence) {
+	return lseek(((posix_file_t*) file)->fd, offset, whence);
+}
+
+static int posix_close(lftpd_vfs_t* vfs, void* file) {
+	int err = close(((posix_file_t*) file)->fd);
+	free(file);
+	return err;
+}
+
+static int posix_stat(lftpd_vfs_t* vfs, const char* path, struct stat* st) {
+	return stat(path, st);
+}
+
+static void* posix_opendir(lftpd_vfs_t* vfs, const char* path) {
+	return opendir(path);
+}
+
+static const char* posix_readdir(lftpd_vfs_t* vfs, void* dir) {
+	struct dirent* entry = readdir((DIR*) dir);
+	if (entry == NULL) {
+		return NULL;
+	}
+	return entry->d_name;
+}
+
+static int posix_closedir(lftpd_vfs_t* vfs, void* dir) {
+	return closedir((DIR*) dir);
+}
+
+static int posix_unlink(lftpd_vfs_t* vfs, const char* path) {
+	return remove(path);
+}
+
+static int posix_mkdir(lftpd_vfs_t* vfs, const char* path) {
+	return mkdir(path, 0777);
+}
+
+static int posix_rename(lftpd_vfs_t* vfs, const char* from, const char* to) {
+	return rename(from, to);
+}
+
+static int posix_utime(lftpd_vfs_t* vfs, const char* path, time_t mtime) {
+	// leave the access time alone
+	struct timespec times[2] = {
+		{ .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+		{ .tv_sec = mtime, .tv_nsec = 0 },
+	};
+	return utimensat(AT_FDCWD, path, times, 0);
+}
+
+static int posix_chmod(lftpd_vfs_t* vfs, const char* path, mode_t mode) {
+	return chmod(path, mode);
+}
+
+#ifdef __linux__
+static ssize_t posix_sendfile(lftpd_vfs_t* vfs, void* file, int socket, off_t* offset, size_t count) {
+	return sendfile(socket, ((posix_file_t*) file)->fd, offset, count);
+}
+
+static int posix_clone(lftpd_vfs_t* vfs, void* from, void* to) {
+	return ioctl(((posix_file_t*) to)->fd, FICLONE, ((posix_file_t*) from)->fd);
+}
+
+static ssize_t posix_copy(lftpd_vfs_t* vfs, void* from, void* to, size_t count) {
+	return copy_file_range(((posix_file_t*) from)->fd, NULL, ((posix_file_t*) to)->fd, NULL, count, 0);
+}
+
+static int posix_watch(lftpd_vfs_t* vfs, const char* path) {
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	// unlinking an open file only changes its link count, which is
+	// IN_ATTRIB
+	uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF;
+	if (inotify_add_watch(fd, path, mask) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+void lftpd_vfs_posix_init(lftpd_vfs_t* vfs) {
+	memset(vfs, 0, sizeof(lftpd_vfs_t));
+	vfs->open = posix_open;
+	vfs->read = posix_read;
+	vfs->write = posix_write;
+	vfs->seek = posix_seek;
+	vfs->close = posix_close;
+	vfs->stat = posix_stat;
+	vfs->opendir = posix_opendir;
+	vfs->readdir = posix_readdir;
+	vfs->closedir = posix_closedir;
+	vfs->unlink = posix_unlink;
+	vfs->mkdir = posix_mkdir;
+	vfs->rename = posix_rename;
+	vfs->utime = posix_utime;
+	vfs->chmod = posix_chmod;
+#ifdef __linux__
+	vfs->sendfile = posix_sendfile;
+	vfs->clone = posix_clone;
+	vfs->copy = posix_copy;
+	vfs->watch = posix_watch;
+#endif
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define LFTPD_CACHE_BUCKETS 64
+
+typedef struct lftpd_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	long long mtime;
+	long long ctime;
+	off_t size;
+	unsigned char* data;
+	int refs;
+	bool linked;
+
+	struct lftpd_cache_entry* bucket_next;
+	struct lftpd_cache_entry* lru_prev;
+	struct lftpd_cache_entry* lru_next;
+} lftpd_cache_entry_t;
+
+typedef struct lftpd_cache {
+	pthread_mutex_t lock;
+	size_t capacity;
+	size_t max_file_size;
+	size_t used;
+	unsigned long hits;
+	unsigned long misses;
+
+	lftpd_cache_entry_t* buckets[LFTPD_CACHE_BUCKETS];
+	// most recently used at the head
+	lftpd_cache_entry_t* lru_head;
+	lftpd_cache_entry_t* lru_tail;
+} lftpd_cache_t;
+
+/**
+ * @brief Create a cache holding at most capacity bytes of file
+ * content, accepting files of up to max_file_size bytes.
+ */
+int lftpd_cache_init(lftpd_cache_t* cache, size_t capacity, size_t max_file_size);
+
+void lftpd_cache_destroy(lftpd_cache_t* cache);
+
+/**
+ * @brief Returns true if a file with these attributes may be cached.
+ */
+bool lftpd_cache_accepts(lftpd_cache_t* cache, const struct stat* st);
+
+/**
+ * @brief Look up the content of the file described by st. The entry
+ * is keyed on device, inode, modification time, change time and size,
+ * so a changed file never hits a stale entry, even if its modification
+ * time was set back afterwards. On a hit the entry is returned with a
+ * reference held which must be dropped with lftpd_cache_release().
+ * Counts a hit or a miss.
+ */
+lftpd_cache_entry_t* lftpd_cache_get(lftpd_cache_t* cache, const struct stat* st);
+
+/**
+ * @brief Insert content for the file described by st, taking ownership
+ * of data, which must be st->st_size bytes allocated with malloc().
+ * Least recently used entries are evicted to make room. Returns the
+ * entry with a reference held, or NULL if it could not be cached, in
+ * which case the caller keeps ownership of data.
+ */
+lftpd_cache_entry_t* lftpd_cache_put(lftpd_cache_t* cache, const struct stat* st, unsigned char* data);
+
+void lftpd_cache_release(lftpd_cache_t* cache, lftpd_cache_entry_t* entry);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Block checksums and delta streams for updating a file in place by
+// sending only what changed, in the style of rsync.
+//
+// The client fetches an Adler-32 and an MD5 for each block of the
+// server's copy, rolls the Adler-32 over its own copy to find blocks
+// the server already has, and uploads a delta stream of records:
+//
+//   'C' offset (8 bytes) length (4 bytes)  copy from the old file
+//   'D' length (4 bytes) data              literal data
+//   'E'                                    end of stream
+//
+// Integers are big endian. The new file is the records applied in
+// order.
+
+#define LFTPD_DELTA_COPY 'C'
+#define LFTPD_DELTA_DATA 'D'
+#define LFTPD_DELTA_END 'E'
+
+/**
+ * @brief Continue an Adler-32 over more data. Start with 1.
+ */
+uint32_t lftpd_delta_adler32(uint32_t adler, const unsigned char* buffer, size_t len);
+
+/**
+ * @brief Slide an Adler-32 of a block_len window forward one byte,
+ * removing out and adding in.
+ */
+uint32_t lftpd_delta_adler32_roll(uint32_t adler, unsigned char out, unsigned char in, size_t block_len);
+
+/**
+ * @brief Called for a copy record. Return non-zero to abort.
+ */
+typedef int (*lftpd_delta_copy_t)(void* context, uint64_t offset, uint32_t len);
+
+/**
+ * @brief Called with successive pieces of literal data. Return non-zero
+ * to abort.
+ */
+typedef int (*lftpd_delta_data_t)(void* context, const unsigned char* buffer, size_t len);
+
+/**
+ * @brief A streaming delta parser. Feed it the stream in pieces of any
+ * size and it calls back for each record.
+ */
+typedef struct {
+	lftpd_delta_copy_t copy;
+	lftpd_delta_data_t data;
+	void* context;
+
+	unsigned char header[13];
+	size_t header_len;
+	uint32_t remaining;
+	bool finished;
+} lftpd_delta_reader_t;
+
+void lftpd_delta_reader_init(lftpd_delta_reader_t* reader, lftpd_delta_copy_t copy,
+		lftpd_delta_data_t data, void* context);
+
+/**
+ * @brief Parse len bytes of stream. Returns 0 on success or -1 if the
+ * stream is malformed, continues past the end record, or a callback
+ * failed.
+ */
+int lftpd_delta_reader_feed(lftpd_delta_reader_t* reader, const unsigned char* buffer, size_t len);
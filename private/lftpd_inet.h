@@ -1,14 +1,84 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
-int lftpd_inet_listen(int port);
+int lftpd_inet_listen(int port, int backlog);
 int lftpd_inet_get_socket_port(int socket);
 
 /**
- * @brief Read a line from the client, terminating when CRLF is received
- * or the buffer length is reached.
+ * @brief Apply a send and receive timeout, in seconds, to the socket.
+ * A timeout of 0 or less leaves the socket blocking forever.
  */
-int lftpd_inet_read_line(int socket, char* buffer, size_t buffer_len);
+int lftpd_inet_set_timeout(int socket, int seconds);
+
+/**
+ * @brief Deliver TCP urgent data in line with the rest of the stream,
+ * so a Telnet Synch reads as ordinary bytes rather than being lost.
+ */
+int lftpd_inet_set_oob_inline(int socket);
+
+/**
+ * @brief Send small writes immediately, so a reply that follows another
+ * isn't held back waiting for the client to acknowledge the first.
+ */
+int lftpd_inet_set_nodelay(int socket);
+
+/**
+ * @brief Make reads on the socket return at once with errno EAGAIN
+ * when nothing has arrived, or wait again.
+ */
+int lftpd_inet_set_nonblocking(int socket, bool nonblocking);
+
+/**
+ * @brief Accept a connection on the listener, giving up after timeout
+ * seconds with errno set to ETIMEDOUT. A timeout of 0 or less waits
+ * forever.
+ */
+int lftpd_inet_accept(int listener_socket, int timeout);
+
+#define LFTPD_INET_LINE_SIZE 512
+
+/**
+ * @brief Input from a control connection that has been read but not yet
+ * returned as a line. Start with it zeroed.
+ */
+typedef struct lftpd_inet_line_buffer {
+	char data[LFTPD_INET_LINE_SIZE];
+	size_t len;
+} lftpd_inet_line_buffer_t;
+
+/**
+ * @brief True if input holds at least one complete line.
+ */
+bool lftpd_inet_has_line(const lftpd_inet_line_buffer_t* input);
+
+/**
+ * @brief Move the first complete line in input, without its CRLF, into
+ * buffer. Returns 0 on success, 1 if input doesn't hold a whole line
+ * yet and -1 if the line is too long for input or buffer.
+ */
+int lftpd_inet_take_line(lftpd_inet_line_buffer_t* input, char* buffer, size_t buffer_len);
+
+/**
+ * @brief Read a line from the client, terminating when CRLF is received.
+ * Each read takes whatever the client has sent, and anything after the
+ * line is kept in input for the next call. flags are passed to recv().
+ * With MSG_DONTWAIT, 1 is returned rather than waiting for the rest of
+ * a line.
+ */
+int lftpd_inet_read_line(int socket, lftpd_inet_line_buffer_t* input, char* buffer, size_t buffer_len, int flags);
+
+/**
+ * @brief Write all of buffer to the socket, retrying short writes.
+ */
+int lftpd_inet_write(int socket, const void* buffer, size_t len);
+
+/**
+ * @brief Write all of the count buffers in iov to the socket in order,
+ * retrying short writes. iov is updated as it is written.
+ */
+int lftpd_inet_writev(int socket, struct iovec* iov, int count);
 
 int lftpd_inet_write_string(int socket, const char* message);
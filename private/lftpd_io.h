@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdbool.h>
+
 /**
  * @brief Given a base path and a name, attempts to combine base and
  * name and produce an absolute path. If either base or name are NULL
@@ -14,3 +17,9 @@
  * 5. The segments are then joined with / and the result is returned.
  */
 char* lftpd_io_canonicalize_path(const char* base, const char* name);
+
+/**
+ * @brief True if all len bytes of buffer are zero. Used to find the
+ * blocks of an upload that can be left as holes.
+ */
+bool lftpd_io_is_zero(const void* buffer, size_t len);
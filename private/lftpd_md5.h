@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// https://tools.ietf.org/html/rfc1321
+
+#define LFTPD_MD5_DIGEST_SIZE 16
+
+typedef struct {
+	uint32_t state[4];
+	uint64_t length;
+	unsigned char buffer[64];
+} lftpd_md5_t;
+
+void lftpd_md5_init(lftpd_md5_t* md5);
+void lftpd_md5_update(lftpd_md5_t* md5, const void* data, size_t len);
+void lftpd_md5_final(lftpd_md5_t* md5, unsigned char digest[LFTPD_MD5_DIGEST_SIZE]);
@@ -18,6 +18,7 @@
 #define STATUS_227 "Entering Passive Mode (%d,%d,%d,%d,%d,%d)."
 #define STATUS_229 "Entering Extended Passive Mode (|||%d|)."
 #define STATUS_230 "User logged in, proceed."
+#define STATUS_234 "Security data exchange complete."
 #define STATUS_250 "Requested file action okay, completed."
 #define STATUS_257 "\"%s\" created."
 #define STATUS_331 "User name okay, need password."
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+// https://www.gnu.org/software/tar/manual/html_node/Standard.html
+
+#define LFTPD_TAR_BLOCK_SIZE 512
+#define LFTPD_TAR_NAME_MAX 1024
+
+#define LFTPD_TAR_TYPE_FILE '0'
+#define LFTPD_TAR_TYPE_DIRECTORY '5'
+#define LFTPD_TAR_TYPE_LONG_NAME 'L'
+
+/**
+ * @brief Format the header for one archive member into buffer. Names
+ * that don't fit in a ustar header are preceded by a GNU long name
+ * member. Returns the number of bytes written, always a multiple of
+ * the block size, or 0 if buffer is too small or the name is longer
+ * than LFTPD_TAR_NAME_MAX.
+ */
+size_t lftpd_tar_header(unsigned char* buffer, size_t buffer_len, const char* name,
+		char type, unsigned long long size, time_t mtime, unsigned int mode);
+
+/**
+ * @brief Number of zero bytes needed after size bytes of member data
+ * to reach the next block boundary.
+ */
+size_t lftpd_tar_padding(unsigned long long size);
+
+/**
+ * @brief Called for each member. Return non-zero to abort extraction.
+ */
+typedef int (*lftpd_tar_entry_t)(void* context, const char* name, char type,
+		unsigned long long size, time_t mtime);
+
+/**
+ * @brief Called with successive pieces of the current member's data.
+ * Return non-zero to abort extraction.
+ */
+typedef int (*lftpd_tar_data_t)(void* context, const unsigned char* buffer, size_t len);
+
+/**
+ * @brief A streaming archive parser. Feed it the archive in pieces of
+ * any size and it calls back for each member and its data, using no
+ * memory beyond this struct.
+ */
+typedef struct {
+	lftpd_tar_entry_t entry;
+	lftpd_tar_data_t data;
+	void* context;
+
+	unsigned char header[LFTPD_TAR_BLOCK_SIZE];
+	size_t header_len;
+	unsigned long long remaining;
+	size_t padding;
+	bool in_long_name;
+	char long_name[LFTPD_TAR_NAME_MAX + 1];
+	size_t long_name_len;
+	bool has_long_name;
+	bool finished;
+} lftpd_tar_reader_t;
+
+void lftpd_tar_reader_init(lftpd_tar_reader_t* reader, lftpd_tar_entry_t entry,
+		lftpd_tar_data_t data, void* context);
+
+/**
+ * @brief Parse len bytes of archive. Returns 0 on success or -1 if the
+ * archive is malformed or a callback failed.
+ */
+int lftpd_tar_reader_feed(lftpd_tar_reader_t* reader, const unsigned char* buffer, size_t len);
+
+/**
+ * @brief True if the archive seen so far ended on a member boundary.
+ */
+bool lftpd_tar_reader_complete(lftpd_tar_reader_t* reader);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// https://tools.ietf.org/html/rfc4217
+// https://docs.kernel.org/networking/tls.html
+
+typedef struct lftpd_tls_context lftpd_tls_context_t;
+typedef struct lftpd_tls lftpd_tls_t;
+
+/**
+ * @brief Create a server context from a PEM certificate chain and
+ * private key. Sessions created from it offload record encryption to
+ * the kernel when the kernel supports it. Returns NULL on error.
+ */
+lftpd_tls_context_t* lftpd_tls_context_create(const char* certificate_file, const char* key_file);
+
+void lftpd_tls_context_destroy(lftpd_tls_context_t* context);
+
+/**
+ * @brief Run the server side of the handshake on a connected socket.
+ * Returns the session, or NULL if the handshake failed. The socket
+ * remains owned by the caller.
+ */
+lftpd_tls_t* lftpd_tls_accept(lftpd_tls_context_t* context, int socket);
+
+/**
+ * @brief Read up to len bytes of application data. Returns the number
+ * of bytes read, 0 when the peer has closed the session or -1 on error.
+ * On a non-blocking socket -1 with errno EAGAIN means no whole record
+ * has arrived yet.
+ */
+ssize_t lftpd_tls_read(lftpd_tls_t* tls, void* buffer, size_t len);
+
+/**
+ * @brief Number of bytes already decrypted and waiting to be read,
+ * which polling the socket won't report.
+ */
+size_t lftpd_tls_pending(lftpd_tls_t* tls);
+
+/**
+ * @brief Write all of buffer, retrying short writes.
+ */
+int lftpd_tls_write(lftpd_tls_t* tls, const void* buffer, size_t len);
+
+/**
+ * @brief True if the kernel encrypts data written to the socket, in
+ * which case plain writes and sendfile() on it are sent as TLS records.
+ */
+bool lftpd_tls_kernel_send(lftpd_tls_t* tls);
+
+/**
+ * @brief True if the kernel decrypts data received on the socket.
+ */
+bool lftpd_tls_kernel_receive(lftpd_tls_t* tls);
+
+/**
+ * @brief Send close_notify and free the session. Does not close the
+ * socket.
+ */
+void lftpd_tls_close(lftpd_tls_t* tls);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+
+#define LFTPD_TRACE_ARG_MAX 64
+
+typedef struct lftpd_trace lftpd_trace_t;
+typedef struct lftpd_trace_buffer lftpd_trace_buffer_t;
+
+/**
+ * @brief Create a tracer keeping the most recent events_per_thread
+ * spans for each session thread. Returns NULL if out of memory.
+ */
+lftpd_trace_t* lftpd_trace_create(size_t events_per_thread);
+
+/**
+ * @brief Free the tracer. No thread may still be attached.
+ */
+void lftpd_trace_destroy(lftpd_trace_t* trace);
+
+/**
+ * @brief Give the calling thread a buffer to record into, reusing one
+ * left by a finished session if possible. Spans are labelled with a
+ * new thread id each time. Returns NULL if out of memory.
+ */
+lftpd_trace_buffer_t* lftpd_trace_attach(lftpd_trace_t* trace);
+
+/**
+ * @brief Hand the buffer back when the thread is done. Its spans stay
+ * in the dump until the buffer is reused and they are overwritten.
+ */
+void lftpd_trace_detach(lftpd_trace_t* trace, lftpd_trace_buffer_t* buffer);
+
+/**
+ * @brief Monotonic time in nanoseconds, for span start times.
+ */
+uint64_t lftpd_trace_now(void);
+
+/**
+ * @brief Record a span from start until now. name must be a string
+ * that lives as long as the tracer. arg, which may be NULL, is copied
+ * and truncated to LFTPD_TRACE_ARG_MAX - 1 bytes. Only the thread that
+ * attached the buffer may record into it. Never blocks; the oldest
+ * span is overwritten when the buffer is full.
+ */
+void lftpd_trace_span(lftpd_trace_buffer_t* buffer, const char* name, const char* arg, uint64_t start);
+
+typedef int (*lftpd_trace_writer_t)(void* context, const void* buffer, size_t len);
+
+/**
+ * @brief Write every recorded span as Chrome trace event JSON, as
+ * loaded by chrome://tracing or Perfetto. Safe to call while sessions
+ * are recording. Spans overwritten during the dump are skipped.
+ */
+int lftpd_trace_dump(lftpd_trace_t* trace, lftpd_trace_writer_t writer, void* context);
@@ -0,0 +1,290 @@
+// Microbenchmarks for the control path. The server's helpers are
+// static, so the server is compiled into this file directly.
+//
+// Usage: bench_lftpd [-m] [-n iterations] [filter]
+//   -m  machine readable output, one tab separated line per benchmark
+//   -n  iterations per benchmark (default 100000)
+//   filter  only run benchmarks whose name contains this string
+
+#define LFTPD_NO_MAIN 1
+#include "../lftpd.c"
+
+#include <time.h>
+#include <fcntl.h>
+
+static unsigned long allocations;
+
+#ifdef __GLIBC__
+// count every allocation, including the ones libc makes internally for
+// asprintf() and strdup()
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void __libc_free(void* p);
+
+void* malloc(size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, size);
+}
+
+void free(void* p) {
+	__libc_free(p);
+}
+#endif
+
+typedef struct {
+	const char* name;
+	void (*setup)(void);
+	void (*run)(long iterations);
+	void (*teardown)(void);
+} bench_t;
+
+static lftpd_t bench_server;
+static lftpd_vfs_t bench_vfs;
+static lftpd_client_t bench_client;
+static int null_fd;
+static int pair[2];
+static pthread_t writer_thread;
+static volatile bool writer_running;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void setup_server(void) {
+	memset(&bench_server, 0, sizeof(bench_server));
+	resolve_limits(&bench_server.limits);
+	bench_server.limits.session_memory = -1;
+	lftpd_vfs_mem_init(&bench_vfs);
+	for (int i = 0; i < 100; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/dir/file%03d.log", i);
+		lftpd_vfs_mem_add_file(&bench_vfs, path, path, strlen(path));
+	}
+	bench_server.vfs = &bench_vfs;
+	pthread_mutex_init(&bench_server.lock, NULL);
+
+	null_fd = open("/dev/null", O_WRONLY);
+	memset(&bench_client, 0, sizeof(bench_client));
+	bench_client.lftpd = &bench_server;
+	bench_client.directory = strdup("/dir");
+	bench_client.socket = null_fd;
+	bench_client.data_socket = null_fd;
+}
+
+static void teardown_server(void) {
+	free(bench_client.directory);
+	close(null_fd);
+	pthread_mutex_destroy(&bench_server.lock);
+	lftpd_vfs_mem_destroy(&bench_vfs);
+}
+
+static void run_canonicalize_deep(long iterations) {
+	for (long i = 0; i < iterations; i++) {
+		free(lftpd_io_canonicalize_path("/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p", "q/r/s/t/u/v/w/x/y/z.txt"));
+	}
+}
+
+static void run_canonicalize_dotdot(long iterations) {
+	for (long i = 0; i < iterations; i++) {
+		free(lftpd_io_canonicalize_path("/one/./two/../three/four//five/.././././..",
+				"../../a/./b/../c/../../d/e/../../../f"));
+	}
+}
+
+static void run_trim(long iterations) {
+	static const char source[] = "  \t  some argument with spaces.txt \t \r\n";
+	char buffer[sizeof(source)];
+	for (long i = 0; i < iterations; i++) {
+		memcpy(buffer, source, sizeof(source));
+		lftpd_string_trim(buffer);
+	}
+}
+
+static void run_send_response(long iterations) {
+	for (long i = 0; i < iterations; i++) {
+		send_simple_response(null_fd, 227, STATUS_227, 127, 0, 0, 1, 195, 80);
+	}
+}
+
+static void run_listing(long iterations, const char* arg, bool names_only) {
+	// listings go through data_write(), which polls the control
+	// connection for ABOR, so give it one with nothing to read
+	int control[2];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, control);
+	bench_client.socket = control[0];
+	for (long i = 0; i < iterations; i++) {
+		send_listing(&bench_client, arg, names_only);
+	}
+	bench_client.socket = null_fd;
+	close(control[0]);
+	close(control[1]);
+}
+
+static void run_send_list(long iterations) {
+	run_listing(iterations, NULL, false);
+}
+
+static void run_nlst_glob(long iterations) {
+	run_listing(iterations, "*7.log", true);
+}
+
+static void run_dispatch_noop(long iterations) {
+	for (long i = 0; i < iterations; i++) {
+		dispatch_command(&bench_client, "NOOP");
+	}
+}
+
+static void run_dispatch_type(long iterations) {
+	for (long i = 0; i < iterations; i++) {
+		dispatch_command(&bench_client, "type I");
+	}
+}
+
+static void run_dispatch_unknown(long iterations) {
+	for (long i = 0; i < iterations; i++) {
+		dispatch_command(&bench_client, "XYZW");
+	}
+}
+
+static void setup_pair(void) {
+	socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+}
+
+static void teardown_pair(void) {
+	close(pair[0]);
+	close(pair[1]);
+}
+
+static void run_read_line_pipelined(long iterations) {
+	// the client sends a burst of commands in one write and the server
+	// takes them off one line at a time
+	static const char line[] = "RETR some/file/name.bin\r\n";
+	char batch[32 * (sizeof(line) - 1)];
+	for (int i = 0; i < 32; i++) {
+		memcpy(batch + i * (sizeof(line) - 1), line, sizeof(line) - 1);
+	}
+	lftpd_inet_line_buffer_t input = { .len = 0 };
+	char buffer[CONTROL_BUFFER_SIZE];
+	for (long i = 0; i < iterations; i += 32) {
+		lftpd_inet_write(pair[1], batch, sizeof(batch));
+		for (int j = 0; j < 32; j++) {
+			lftpd_inet_read_line(pair[0], &input, buffer, sizeof(buffer), 0);
+		}
+	}
+}
+
+static void* fragment_writer(void* arg) {
+	// dribble lines out a few bytes per write
+	static const char line[] = "STOR a/rather/long/path/to/upload/into/file.bin\r\n";
+	long iterations = (long) arg;
+	for (long i = 0; i < iterations && writer_running; i++) {
+		for (size_t j = 0; j < sizeof(line) - 1; j += 5) {
+			size_t n = sizeof(line) - 1 - j < 5 ? sizeof(line) - 1 - j : 5;
+			if (write(pair[1], line + j, n) < 0) {
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void run_read_line_fragmented(long iterations) {
+	lftpd_inet_line_buffer_t input = { .len = 0 };
+	char buffer[CONTROL_BUFFER_SIZE];
+	writer_running = true;
+	pthread_create(&writer_thread, NULL, fragment_writer, (void*) iterations);
+	for (long i = 0; i < iterations; i++) {
+		if (lftpd_inet_read_line(pair[0], &input, buffer, sizeof(buffer), 0) != 0) {
+			break;
+		}
+	}
+	writer_running = false;
+	pthread_join(writer_thread, NULL);
+}
+
+static bench_t benches[] = {
+	{ "canonicalize_path_deep", NULL, run_canonicalize_deep, NULL },
+	{ "canonicalize_path_dotdot", NULL, run_canonicalize_dotdot, NULL },
+	{ "string_trim", NULL, run_trim, NULL },
+	{ "send_response", setup_server, run_send_response, teardown_server },
+	{ "send_list_100", setup_server, run_send_list, teardown_server },
+	{ "nlst_glob_100", setup_server, run_nlst_glob, teardown_server },
+	{ "dispatch_noop", setup_server, run_dispatch_noop, teardown_server },
+	{ "dispatch_type", setup_server, run_dispatch_type, teardown_server },
+	{ "dispatch_unknown", setup_server, run_dispatch_unknown, teardown_server },
+	{ "read_line_pipelined", setup_pair, run_read_line_pipelined, teardown_pair },
+	{ "read_line_fragmented", setup_pair, run_read_line_fragmented, teardown_pair },
+	{ NULL, NULL, NULL, NULL },
+};
+
+int main(int argc, char* argv[]) {
+	bool machine = false;
+	long iterations = 100000;
+	const char* filter = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0) {
+			machine = true;
+		}
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			iterations = atol(argv[++i]);
+		}
+		else {
+			filter = argv[i];
+		}
+	}
+	if (iterations < 32) {
+		iterations = 32;
+	}
+
+	if (machine) {
+		printf("name\titerations\tns_per_op\tallocs_per_op\n");
+	}
+	else {
+		printf("%-28s %12s %12s %14s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+	}
+	for (int i = 0; benches[i].name; i++) {
+		bench_t* bench = &benches[i];
+		if (filter && strstr(bench->name, filter) == NULL) {
+			continue;
+		}
+		// listings are large, so run them fewer times
+		bool listing = strstr(bench->name, "list") || strstr(bench->name, "nlst");
+		long n = listing ? iterations / 100 + 1 : iterations;
+		if (bench->setup) {
+			bench->setup();
+		}
+		// warm up, then measure
+		bench->run(n / 10 + 1);
+		unsigned long allocations_start = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+		uint64_t start = now_ns();
+		bench->run(n);
+		uint64_t elapsed = now_ns() - start;
+		unsigned long allocations_used = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocations_start;
+		if (bench->teardown) {
+			bench->teardown();
+		}
+
+		double ns_per_op = (double) elapsed / n;
+		double allocs_per_op = (double) allocations_used / n;
+		if (machine) {
+			printf("%s\t%ld\t%.1f\t%.2f\n", bench->name, n, ns_per_op, allocs_per_op);
+		}
+		else {
+			printf("%-28s %12ld %12.1f %14.2f\n", bench->name, n, ns_per_op, allocs_per_op);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include "private/lftpd_cache.h"
+
+static void check(const char* name, int passed) {
+	printf("%s = %s\n", name, passed ? "PASS" : "FAIL");
+	assert(passed);
+}
+
+static struct stat file_stat(ino_t ino, off_t size, time_t mtime) {
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0666;
+	st.st_dev = 1;
+	st.st_ino = ino;
+	st.st_size = size;
+	st.st_mtime = mtime;
+	return st;
+}
+
+static lftpd_cache_entry_t* put(lftpd_cache_t* cache, const struct stat* st, char fill) {
+	unsigned char* data = malloc(st->st_size);
+	memset(data, fill, st->st_size);
+	lftpd_cache_entry_t* entry = lftpd_cache_put(cache, st, data);
+	if (entry == NULL) {
+		free(data);
+	}
+	return entry;
+}
+
+int main() {
+	lftpd_cache_t cache;
+	lftpd_cache_init(&cache, 300, 200);
+
+	struct stat a = file_stat(1, 100, 1000);
+	struct stat b = file_stat(2, 100, 1000);
+	struct stat c = file_stat(3, 100, 1000);
+	struct stat d = file_stat(4, 100, 1000);
+	struct stat big = file_stat(5, 201, 1000);
+
+	check("accepts small file", lftpd_cache_accepts(&cache, &a));
+	check("rejects large file", !lftpd_cache_accepts(&cache, &big));
+	check("miss when empty", lftpd_cache_get(&cache, &a) == NULL);
+
+	lftpd_cache_release(&cache, put(&cache, &a, 'a'));
+	lftpd_cache_release(&cache, put(&cache, &b, 'b'));
+	lftpd_cache_release(&cache, put(&cache, &c, 'c'));
+	lftpd_cache_entry_t* entry = lftpd_cache_get(&cache, &a);
+	check("hit", entry != NULL && entry->data[0] == 'a');
+
+	// a is now most recently used so d evicts b
+	lftpd_cache_release(&cache, put(&cache, &d, 'd'));
+	check("lru eviction", lftpd_cache_get(&cache, &b) == NULL);
+	check("used within capacity", cache.used <= cache.capacity);
+
+	// an entry in use survives eviction until it is released
+	check("in use entry readable", entry->data[99] == 'a');
+	lftpd_cache_release(&cache, entry);
+
+	struct stat c_changed = file_stat(3, 100, 2000);
+	check("changed mtime misses", lftpd_cache_get(&cache, &c_changed) == NULL);
+	check("stale entry evicted", lftpd_cache_get(&cache, &c) == NULL);
+	check("hit and miss counts", cache.hits == 1 && cache.misses == 4);
+
+	// rewritten with the same size and the mtime set back
+	lftpd_cache_release(&cache, put(&cache, &d, 'd'));
+	struct stat d_rewritten = d;
+	d_rewritten.st_ctime = d.st_ctime + 1;
+	check("changed ctime misses", lftpd_cache_get(&cache, &d_rewritten) == NULL);
+
+	lftpd_cache_destroy(&cache);
+}
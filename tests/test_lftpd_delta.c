@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "private/lftpd_delta.h"
+#include "private/lftpd_md5.h"
+
+typedef struct {
+	uint64_t copied;
+	size_t data_len;
+	int records;
+} result_t;
+
+static void check(const char* name, int passed) {
+	printf("%s = %s\n", name, passed ? "PASS" : "FAIL");
+	assert(passed);
+}
+
+static int on_copy(void* context, uint64_t offset, uint32_t len) {
+	result_t* result = context;
+	result->copied += offset + len;
+	result->records++;
+	return 0;
+}
+
+static int on_data(void* context, const unsigned char* buffer, size_t len) {
+	result_t* result = context;
+	result->data_len += len;
+	return 0;
+}
+
+static void md5_hex(const char* s, char* hex) {
+	lftpd_md5_t md5;
+	unsigned char digest[LFTPD_MD5_DIGEST_SIZE];
+	lftpd_md5_init(&md5);
+	lftpd_md5_update(&md5, s, strlen(s));
+	lftpd_md5_final(&md5, digest);
+	for (int i = 0; i < LFTPD_MD5_DIGEST_SIZE; i++) {
+		sprintf(hex + i * 2, "%02x", digest[i]);
+	}
+}
+
+int main() {
+	const unsigned char* wiki = (const unsigned char*) "Wikipedia";
+	check("adler32", lftpd_delta_adler32(1, wiki, 9) == 0x11e60398);
+
+	// rolling the window one byte at a time matches a fresh sum
+	unsigned char data[20000];
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = (unsigned char) (i * 7919 + (i >> 3));
+	}
+	size_t block = 6000;
+	uint32_t rolling = lftpd_delta_adler32(1, data, block);
+	int matches = 1;
+	for (size_t i = 1; i + block <= sizeof(data); i++) {
+		rolling = lftpd_delta_adler32_roll(rolling, data[i - 1], data[i + block - 1], block);
+		matches &= rolling == lftpd_delta_adler32(1, data + i, block);
+	}
+	check("adler32 roll", matches);
+
+	char hex[LFTPD_MD5_DIGEST_SIZE * 2 + 1];
+	md5_hex("", hex);
+	check("md5 empty", strcmp(hex, "d41d8cd98f00b204e9800998ecf8427e") == 0);
+	md5_hex("The quick brown fox jumps over the lazy dog", hex);
+	check("md5", strcmp(hex, "9e107d9d372bb6826bd81d3542a419d6") == 0);
+
+	unsigned char stream[] = {
+		'C', 0, 0, 0, 0, 0, 0, 0, 0x10, 0, 0, 0, 0x20,
+		'D', 0, 0, 0, 3, 'a', 'b', 'c',
+		'C', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01,
+		'E',
+	};
+	result_t result;
+	memset(&result, 0, sizeof(result));
+	lftpd_delta_reader_t reader;
+	lftpd_delta_reader_init(&reader, on_copy, on_data, &result);
+	for (size_t i = 0; i < sizeof(stream); i++) {
+		assert(lftpd_delta_reader_feed(&reader, stream + i, 1) == 0);
+	}
+	check("records", result.records == 2 && result.copied == 0x31 && result.data_len == 3);
+	check("finished", reader.finished);
+	check("data after end", lftpd_delta_reader_feed(&reader, stream, 1) != 0);
+
+	unsigned char bad[] = { 'Z' };
+	lftpd_delta_reader_init(&reader, on_copy, on_data, &result);
+	check("bad record", lftpd_delta_reader_feed(&reader, bad, 1) != 0);
+	lftpd_delta_reader_init(&reader, on_copy, on_data, &result);
+	lftpd_delta_reader_feed(&reader, stream, sizeof(stream) - 1);
+	check("truncated", !reader.finished);
+}
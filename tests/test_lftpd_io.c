@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdbool.h>
 
 #include "private/lftpd_io.h"
 
@@ -15,6 +16,12 @@ void test_lftpd_io_canonicalize_path(const char* base, const char* name, const c
 	free(path);
 }
 
+void test_lftpd_io_is_zero(const char* name, const void* buffer, size_t len, bool expected) {
+	bool zero = lftpd_io_is_zero(buffer, len);
+	printf("lftpd_io_is_zero(%s) -> %d = %s\n", name, zero, zero == expected ? "PASS" : "FAIL");
+	assert(zero == expected);
+}
+
 int main() {
 	test_lftpd_io_canonicalize_path("/", "name", "/name");
 	test_lftpd_io_canonicalize_path("/base", "name", "/base/name");
@@ -31,4 +38,18 @@ int main() {
 	test_lftpd_io_canonicalize_path("/", "", "/");
 	test_lftpd_io_canonicalize_path("", "/", "/");
 	test_lftpd_io_canonicalize_path("", "", "/");
+
+	static unsigned char block[4096];
+	test_lftpd_io_is_zero("empty", block, 0, true);
+	test_lftpd_io_is_zero("one zero", block, 1, true);
+	test_lftpd_io_is_zero("zero block", block, sizeof(block), true);
+	block[0] = 1;
+	test_lftpd_io_is_zero("first byte set", block, sizeof(block), false);
+	block[0] = 0;
+	block[sizeof(block) - 1] = 0x80;
+	test_lftpd_io_is_zero("last byte set", block, sizeof(block), false);
+	test_lftpd_io_is_zero("before last byte", block, sizeof(block) - 1, true);
+	block[sizeof(block) - 1] = 0;
+	block[1000] = 1;
+	test_lftpd_io_is_zero("middle byte set", block, sizeof(block), false);
 }
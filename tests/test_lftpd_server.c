@@ -0,0 +1,239 @@
+// Tests that run a whole server on the loopback interface and talk to
+// it as a client would. The server is compiled into this file so the
+// tests can reach its internals.
+
+#define LFTPD_NO_MAIN 1
+#include "../lftpd.c"
+
+#include <assert.h>
+
+#define TEST_PORT 21921
+
+static void check(const char* name, int passed) {
+	printf("%s = %s\n", name, passed ? "PASS" : "FAIL");
+	assert(passed);
+}
+
+static void* server_thread(void* arg) {
+	lftpd_start("/", TEST_PORT, arg);
+	return NULL;
+}
+
+static int connect_port(int port) {
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	if (connect(s, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/**
+ * @brief Read a reply, skipping the lines of a multiline one, and
+ * return its code.
+ */
+static int read_reply(int s) {
+	char line[512];
+	while (true) {
+		size_t len = 0;
+		while (len < sizeof(line) - 1 && (len < 2 || line[len - 2] != '\r' || line[len - 1] != '\n')) {
+			if (read(s, line + len, 1) != 1) {
+				return -1;
+			}
+			len++;
+		}
+		line[len] = '\0';
+		if (len >= 4 && isdigit((unsigned char) line[0]) && line[3] == ' ') {
+			return atoi(line);
+		}
+	}
+}
+
+static int command(int s, const char* line) {
+	char buffer[512];
+	snprintf(buffer, sizeof(buffer), "%s\r\n", line);
+	if (lftpd_inet_write(s, buffer, strlen(buffer)) != 0) {
+		return -1;
+	}
+	return read_reply(s);
+}
+
+static int session(void) {
+	// the server may still be starting up
+	for (int i = 0; i < 100; i++) {
+		int s = connect_port(TEST_PORT);
+		if (s >= 0) {
+			return read_reply(s) == 220 ? s : -1;
+		}
+		usleep(10 * 1000);
+	}
+	return -1;
+}
+
+/**
+ * @brief Open a data connection with EPSV, returning its socket or -1
+ * with the reply code in reply.
+ */
+static int data_connection(int s, int* reply) {
+	char buffer[512] = "EPSV\r\n";
+	lftpd_inet_write(s, buffer, strlen(buffer));
+	size_t len = 0;
+	while (len < sizeof(buffer) - 1 && read(s, buffer + len, 1) == 1 && buffer[len] != '\n') {
+		len++;
+	}
+	buffer[len] = '\0';
+	*reply = atoi(buffer);
+	char* p = strstr(buffer, "(|||");
+	return *reply == 229 && p ? connect_port(atoi(p + 4)) : -1;
+}
+
+static size_t read_all(int s, char* buffer, size_t len) {
+	size_t total = 0;
+	ssize_t read_len;
+	while (total < len && (read_len = read(s, buffer + total, len - total)) > 0) {
+		total += read_len;
+	}
+	return total;
+}
+
+static void test_checksums(lftpd_t* lftpd) {
+	// eight threads' buffers don't fit in the default budget, so fewer
+	// are used rather than none
+	lftpd->checksum_threads = 8;
+	int s = session();
+	int reply;
+	int data = data_connection(s, &reply);
+	check("checksums data connection", data >= 0);
+	check("checksums started", command(s, "SITE CHECKSUMS 4096 /big.bin") == 150);
+	static char listing[64 * 1024];
+	size_t len = read_all(data, listing, sizeof(listing) - 1);
+	listing[len] = '\0';
+	close(data);
+	check("checksums complete", read_reply(s) == 226);
+	int lines = 0;
+	for (char* p = listing; (p = strstr(p, "\r\n")); p += 2) {
+		lines++;
+	}
+	check("checksums header", strncmp(listing, "307200 4096 75\r\n", 16) == 0);
+	check("checksums one line per block", lines == 76);
+	check("checksums thread count", checksum_thread_count(&(lftpd_client_t) { .lftpd = lftpd },
+			CHECKSUM_BATCH_BLOCKS * sizeof(block_checksum_t)) > 1);
+	command(s, "QUIT");
+	close(s);
+
+	// a count above the maximum is capped
+	lftpd->checksum_threads = 64;
+	check("checksums thread cap", checksum_thread_count(&(lftpd_client_t) { .lftpd = lftpd }, 0)
+			<= MAX_CHECKSUM_THREADS);
+	lftpd->checksum_threads = 0;
+}
+
+/**
+ * @brief Read a block mode transfer up to its EOF block, returning the
+ * number of data bytes.
+ */
+static size_t read_blocks(int s) {
+	size_t total = 0;
+	unsigned char header[3];
+	static char data[64 * 1024];
+	while (read_all(s, (char*) header, sizeof(header)) == sizeof(header)) {
+		size_t len = (header[1] << 8) | header[2];
+		if (read_all(s, data, len) != len) {
+			break;
+		}
+		total += len;
+		if (header[0] & BLOCK_EOF) {
+			break;
+		}
+	}
+	return total;
+}
+
+static void test_block_mode_slot(lftpd_t* lftpd) {
+	// a block mode connection kept open between transfers doesn't hold
+	// the only transfer slot
+	int max_transfers = lftpd->limits.max_transfers;
+	lftpd->limits.max_transfers = 1;
+	int a = session();
+	check("block slot mode b", command(a, "MODE B") == 200);
+	int reply;
+	int data = data_connection(a, &reply);
+	check("block slot data connection", data >= 0);
+	check("block slot retr started", command(a, "RETR /big.bin") == 150);
+	check("block slot retr data", read_blocks(data) == 300 * 1024);
+	check("block slot connection kept", read_reply(a) == 250);
+
+	int b = session();
+	int b_data = data_connection(b, &reply);
+	check("block slot second session epsv", reply == 229 && b_data >= 0);
+
+	// the second session has the slot now, so the first waits for it
+	check("block slot retr without slot", command(a, "RETR /big.bin") == 425);
+	close(b_data);
+	command(b, "QUIT");
+	close(b);
+	// the server closes the second session's data connection as it
+	// ends, so give it a moment
+	int code = 0;
+	for (int i = 0; i < 100 && code != 150; i++) {
+		usleep(10 * 1000);
+		code = command(a, "RETR /big.bin");
+	}
+	check("block slot retr again", code == 150 && read_blocks(data) == 300 * 1024);
+	check("block slot connection kept again", read_reply(a) == 250);
+	close(data);
+	command(a, "QUIT");
+	close(a);
+	lftpd->limits.max_transfers = max_transfers;
+}
+
+static void test_stop(lftpd_t* lftpd, pthread_t thread) {
+	// a session waiting in EPSV for a data connection that never comes
+	// is woken by lftpd_stop() rather than left for the idle timeout
+	int s = session();
+	int reply;
+	int data = data_connection(s, &reply);
+	check("stop session in epsv", reply == 229 && data >= 0);
+	close(data);
+	int waiting = session();
+	char line[] = "EPSV\r\n";
+	lftpd_inet_write(waiting, line, strlen(line));
+	check("stop second session in epsv", read_reply(waiting) == 229);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	lftpd_stop(lftpd);
+	pthread_join(thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	check("stop wakes waiting sessions", end.tv_sec - start.tv_sec < 5);
+	close(s);
+	close(waiting);
+}
+
+int main() {
+	signal(SIGPIPE, SIG_IGN);
+
+	lftpd_vfs_t vfs;
+	lftpd_vfs_mem_init(&vfs);
+	static unsigned char big[300 * 1024];
+	for (size_t i = 0; i < sizeof(big); i++) {
+		big[i] = (unsigned char) (i * 7);
+	}
+	lftpd_vfs_mem_add_file(&vfs, "/big.bin", big, sizeof(big));
+
+	lftpd_t lftpd = { .vfs = &vfs };
+	pthread_t thread;
+	pthread_create(&thread, NULL, server_thread, &lftpd);
+
+	test_checksums(&lftpd);
+	test_block_mode_slot(&lftpd);
+	test_stop(&lftpd, thread);
+
+	lftpd_vfs_mem_destroy(&vfs);
+	return 0;
+}
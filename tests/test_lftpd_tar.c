@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "private/lftpd_tar.h"
+
+typedef struct {
+	char names[4][LFTPD_TAR_NAME_MAX + 1];
+	char types[4];
+	unsigned long long sizes[4];
+	int count;
+	size_t data_len;
+} result_t;
+
+static void check(const char* name, int passed) {
+	printf("%s = %s\n", name, passed ? "PASS" : "FAIL");
+	assert(passed);
+}
+
+static int on_entry(void* context, const char* name, char type, unsigned long long size, time_t mtime) {
+	result_t* result = context;
+	strcpy(result->names[result->count], name);
+	result->types[result->count] = type;
+	result->sizes[result->count] = size;
+	result->count++;
+	return 0;
+}
+
+static int on_data(void* context, const unsigned char* buffer, size_t len) {
+	result_t* result = context;
+	for (size_t i = 0; i < len; i++) {
+		assert(buffer[i] == 'x');
+	}
+	result->data_len += len;
+	return 0;
+}
+
+int main() {
+	static unsigned char archive[16 * 1024];
+	size_t len = 0;
+
+	char long_name[301];
+	memset(long_name, 'n', 300);
+	long_name[300] = '\0';
+	char split_name[200];
+	memset(split_name, 'p', 120);
+	strcpy(split_name + 120, "/file.txt");
+
+	len += lftpd_tar_header(archive + len, sizeof(archive) - len, "dir/", LFTPD_TAR_TYPE_DIRECTORY, 0, 0, 0755);
+	len += lftpd_tar_header(archive + len, sizeof(archive) - len, split_name, LFTPD_TAR_TYPE_FILE, 1000, 0, 0644);
+	memset(archive + len, 'x', 1000);
+	len += 1000 + lftpd_tar_padding(1000);
+	size_t long_len = lftpd_tar_header(archive + len, sizeof(archive) - len, long_name, LFTPD_TAR_TYPE_FILE, 10, 0, 0644);
+	check("long name uses extra blocks", long_len > LFTPD_TAR_BLOCK_SIZE);
+	len += long_len;
+	memset(archive + len, 'x', 10);
+	len += 10 + lftpd_tar_padding(10);
+	len += 2 * LFTPD_TAR_BLOCK_SIZE;
+	check("archive is block aligned", len % LFTPD_TAR_BLOCK_SIZE == 0);
+	char too_long[LFTPD_TAR_NAME_MAX + 2];
+	memset(too_long, 't', sizeof(too_long) - 1);
+	too_long[sizeof(too_long) - 1] = '\0';
+	unsigned char scratch[4 * 1024];
+	check("name too long", lftpd_tar_header(scratch, sizeof(scratch), too_long, LFTPD_TAR_TYPE_FILE, 0, 0, 0) == 0);
+
+	// feed the archive a few bytes at a time to exercise the state
+	// machine across every boundary
+	result_t result;
+	memset(&result, 0, sizeof(result));
+	lftpd_tar_reader_t reader;
+	lftpd_tar_reader_init(&reader, on_entry, on_data, &result);
+	for (size_t i = 0; i < len; i += 7) {
+		size_t n = len - i < 7 ? len - i : 7;
+		assert(lftpd_tar_reader_feed(&reader, archive + i, n) == 0);
+	}
+	check("three members", result.count == 3);
+	check("directory", strcmp(result.names[0], "dir/") == 0 && result.types[0] == LFTPD_TAR_TYPE_DIRECTORY);
+	check("prefix split name", strcmp(result.names[1], split_name) == 0 && result.sizes[1] == 1000);
+	check("long name", strcmp(result.names[2], long_name) == 0 && result.sizes[2] == 10);
+	check("data", result.data_len == 1010);
+	check("complete", lftpd_tar_reader_complete(&reader));
+
+	// a corrupt header is rejected
+	archive[0] ^= 1;
+	memset(&result, 0, sizeof(result));
+	lftpd_tar_reader_init(&reader, on_entry, on_data, &result);
+	check("bad checksum", lftpd_tar_reader_feed(&reader, archive, len) != 0);
+
+	// an archive cut off mid member is incomplete
+	archive[0] ^= 1;
+	lftpd_tar_reader_init(&reader, on_entry, on_data, &result);
+	lftpd_tar_reader_feed(&reader, archive, 1000);
+	check("truncated", !lftpd_tar_reader_complete(&reader));
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+
+#include "private/lftpd_tls.h"
+#include "private/lftpd_inet.h"
+
+#define CERTIFICATE_FILE "test_lftpd_tls_cert.pem"
+#define KEY_FILE "test_lftpd_tls_key.pem"
+
+typedef struct {
+	lftpd_tls_context_t* context;
+	int listener;
+	char received[64];
+	ssize_t received_len;
+	ssize_t eof;
+	bool kernel_send;
+} server_t;
+
+static void check(const char* name, int passed) {
+	printf("%s = %s\n", name, passed ? "PASS" : "FAIL");
+	assert(passed);
+}
+
+static void write_self_signed(void) {
+	EVP_PKEY* key = EVP_EC_gen("P-256");
+	X509* cert = X509_new();
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 60 * 60);
+	X509_NAME* name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*) "localhost", -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	X509_set_pubkey(cert, key);
+	X509_sign(cert, key, EVP_sha256());
+
+	FILE* f = fopen(CERTIFICATE_FILE, "w");
+	PEM_write_X509(f, cert);
+	fclose(f);
+	f = fopen(KEY_FILE, "w");
+	PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+	fclose(f);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+}
+
+static void* server_thread(void* arg) {
+	server_t* server = arg;
+	int socket = accept(server->listener, NULL, NULL);
+	lftpd_tls_t* tls = lftpd_tls_accept(server->context, socket);
+	if (tls) {
+		server->kernel_send = lftpd_tls_kernel_send(tls);
+		server->received_len = lftpd_tls_read(tls, server->received, sizeof(server->received));
+		lftpd_tls_write(tls, "pong", 4);
+		server->eof = lftpd_tls_read(tls, server->received + server->received_len, 1);
+		lftpd_tls_close(tls);
+	}
+	close(socket);
+	return NULL;
+}
+
+int main() {
+	write_self_signed();
+
+	check("missing certificate", lftpd_tls_context_create("missing.pem", KEY_FILE) == NULL);
+	check("key is not a certificate", lftpd_tls_context_create(KEY_FILE, KEY_FILE) == NULL);
+
+	server_t server;
+	memset(&server, 0, sizeof(server));
+	server.context = lftpd_tls_context_create(CERTIFICATE_FILE, KEY_FILE);
+	check("load certificate", server.context != NULL);
+
+	// a real TCP connection over loopback, so kTLS is used if the kernel
+	// has it
+	server.listener = lftpd_inet_listen(0, 1);
+	int port = lftpd_inet_get_socket_port(server.listener);
+	pthread_t thread;
+	pthread_create(&thread, NULL, server_thread, &server);
+
+	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	check("connect", connect(socket_fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+
+	SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+	SSL* ssl = SSL_new(client_ctx);
+	SSL_set_fd(ssl, socket_fd);
+	check("handshake", SSL_connect(ssl) == 1);
+	check("client write", SSL_write(ssl, "ping", 4) == 4);
+	char reply[8];
+	check("client read", SSL_read(ssl, reply, sizeof(reply)) == 4 && memcmp(reply, "pong", 4) == 0);
+	SSL_shutdown(ssl);
+	pthread_join(thread, NULL);
+
+	check("server read", server.received_len == 4 && memcmp(server.received, "ping", 4) == 0);
+	check("close notify reads as end", server.eof == 0);
+	printf("kernel send = %s\n", server.kernel_send ? "yes" : "no");
+
+	SSL_free(ssl);
+	SSL_CTX_free(client_ctx);
+	close(socket_fd);
+	close(server.listener);
+	lftpd_tls_context_destroy(server.context);
+	unlink(CERTIFICATE_FILE);
+	unlink(KEY_FILE);
+}
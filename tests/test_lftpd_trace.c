@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "private/lftpd_trace.h"
+
+typedef struct {
+	char data[16384];
+	size_t len;
+} output_t;
+
+static void check(const char* name, int passed) {
+	printf("%s = %s\n", name, passed ? "PASS" : "FAIL");
+	assert(passed);
+}
+
+static int output_writer(void* context, const void* buffer, size_t len) {
+	output_t* output = context;
+	if (output->len + len >= sizeof(output->data)) {
+		return -1;
+	}
+	memcpy(output->data + output->len, buffer, len);
+	output->len += len;
+	output->data[output->len] = '\0';
+	return 0;
+}
+
+static int failing_writer(void* context, const void* buffer, size_t len) {
+	return -1;
+}
+
+static int count(const char* haystack, const char* needle) {
+	int n = 0;
+	for (const char* p = haystack; (p = strstr(p, needle)) != NULL; p++) {
+		n++;
+	}
+	return n;
+}
+
+static void dump(lftpd_trace_t* trace, output_t* output) {
+	output->len = 0;
+	output->data[0] = '\0';
+	assert(lftpd_trace_dump(trace, output_writer, output) == 0);
+}
+
+static bool recording;
+
+static void* record_thread(void* arg) {
+	lftpd_trace_t* trace = arg;
+	lftpd_trace_buffer_t* buffer = lftpd_trace_attach(trace);
+	char span_arg[LFTPD_TRACE_ARG_MAX];
+	for (int i = 0; __atomic_load_n(&recording, __ATOMIC_RELAXED); i++) {
+		snprintf(span_arg, sizeof(span_arg), "%d", i);
+		lftpd_trace_span(buffer, "busy", span_arg, lftpd_trace_now());
+	}
+	lftpd_trace_detach(trace, buffer);
+	return NULL;
+}
+
+int main() {
+	check("zero events disables", lftpd_trace_create(0) == NULL);
+
+	lftpd_trace_t* trace = lftpd_trace_create(4);
+	check("create", trace != NULL);
+
+	output_t* output = malloc(sizeof(output_t));
+	dump(trace, output);
+	check("empty dump", strcmp(output->data, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n]}\n") == 0);
+
+	lftpd_trace_buffer_t* buffer = lftpd_trace_attach(trace);
+	uint64_t start = lftpd_trace_now();
+	lftpd_trace_span(buffer, "RETR", "big.bin", start);
+	dump(trace, output);
+	check("span recorded", strstr(output->data, "\"name\":\"RETR\"") != NULL);
+	check("span is complete event", strstr(output->data, "\"ph\":\"X\"") != NULL);
+	check("span arg", strstr(output->data, "\"args\":{\"arg\":\"big.bin\"}") != NULL);
+	check("span start in microseconds", strstr(output->data, "\"ts\":") != NULL);
+
+	lftpd_trace_span(buffer, "NOOP", NULL, lftpd_trace_now());
+	dump(trace, output);
+	check("span without arg", count(output->data, "\"args\"") == 1);
+
+	lftpd_trace_span(buffer, "CWD", "say \"hi\"\n\\", lftpd_trace_now());
+	dump(trace, output);
+	check("arg escaped", strstr(output->data, "say \\\"hi\\\"\\u000a\\\\") != NULL);
+
+	char long_arg[200];
+	memset(long_arg, 'x', sizeof(long_arg) - 1);
+	long_arg[sizeof(long_arg) - 1] = '\0';
+	lftpd_trace_span(buffer, "LONG", long_arg, lftpd_trace_now());
+	dump(trace, output);
+	check("arg truncated", count(output->data, "x") == LFTPD_TRACE_ARG_MAX - 1);
+
+	// the oldest spans make way for new ones
+	lftpd_trace_span(buffer, "STOR", NULL, lftpd_trace_now());
+	dump(trace, output);
+	check("full buffer keeps newest", count(output->data, "\"ph\"") == 4);
+	check("full buffer drops oldest", strstr(output->data, "RETR") == NULL);
+	check("full buffer keeps order", strstr(output->data, "NOOP") < strstr(output->data, "STOR"));
+
+	// a finished session's spans outlive it until the buffer is reused
+	lftpd_trace_detach(trace, buffer);
+	dump(trace, output);
+	check("detached spans kept", count(output->data, "\"ph\"") == 4);
+	lftpd_trace_buffer_t* reused = lftpd_trace_attach(trace);
+	check("buffer reused", reused == buffer);
+	lftpd_trace_span(reused, "QUIT", NULL, lftpd_trace_now());
+	dump(trace, output);
+	check("new session has new tid", count(output->data, "\"tid\":1,") == 3 && count(output->data, "\"tid\":2,") == 1);
+
+	lftpd_trace_buffer_t* second = lftpd_trace_attach(trace);
+	check("attached buffers not shared", second != reused);
+	lftpd_trace_span(second, "PASV", NULL, lftpd_trace_now());
+	dump(trace, output);
+	check("all buffers dumped", count(output->data, "\"ph\"") == 5);
+
+	check("writer error", lftpd_trace_dump(trace, failing_writer, NULL) != 0);
+	lftpd_trace_detach(trace, reused);
+	lftpd_trace_detach(trace, second);
+	lftpd_trace_destroy(trace);
+
+	// dump while another thread records as fast as it can, every span
+	// that makes it out must be whole
+	trace = lftpd_trace_create(64);
+	__atomic_store_n(&recording, true, __ATOMIC_RELAXED);
+	pthread_t thread;
+	pthread_create(&thread, NULL, record_thread, trace);
+	bool whole = true;
+	for (int i = 0; i < 1000; i++) {
+		dump(trace, output);
+		int events = count(output->data, "\"ph\"");
+		whole = whole && events <= 64 && count(output->data, "\"name\":\"busy\"") == events
+				&& count(output->data, "\"args\":{\"arg\":\"") == events;
+	}
+	__atomic_store_n(&recording, false, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	check("dump during recording", whole);
+	lftpd_trace_destroy(trace);
+
+	free(output);
+}
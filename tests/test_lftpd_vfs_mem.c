@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include "lftpd_vfs.h"
+
+static void check(const char* name, int passed) {
+	printf("%s = %s\n", name, passed ? "PASS" : "FAIL");
+	assert(passed);
+}
+
+static size_t read_all(lftpd_vfs_t* vfs, const char* path, char* buffer, size_t len) {
+	void* file = vfs->open(vfs, path, LFTPD_VFS_READ);
+	assert(file != NULL);
+	size_t total = 0;
+	ssize_t read_len;
+	while ((read_len = vfs->read(vfs, file, buffer + total, len - total)) > 0) {
+		total += read_len;
+	}
+	vfs->close(vfs, file);
+	return total;
+}
+
+static int count_entries(lftpd_vfs_t* vfs, const char* path) {
+	void* dir = vfs->opendir(vfs, path);
+	if (dir == NULL) {
+		return -1;
+	}
+	int count = 0;
+	while (vfs->readdir(vfs, dir)) {
+		count++;
+	}
+	vfs->closedir(vfs, dir);
+	return count;
+}
+
+int main() {
+	lftpd_vfs_t vfs;
+	assert(lftpd_vfs_mem_init(&vfs) == 0);
+	char buffer[64];
+	struct stat st;
+
+	check("add file with parents", lftpd_vfs_mem_add_file(&vfs, "/etc/config/a.txt", "hello", 5) == 0);
+	check("stat directory", vfs.stat(&vfs, "/etc/config", &st) == 0 && S_ISDIR(st.st_mode));
+	check("stat file", vfs.stat(&vfs, "/etc/config/a.txt", &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 5);
+	check("stat missing", vfs.stat(&vfs, "/etc/missing", &st) != 0);
+	size_t len = read_all(&vfs, "/etc/config/a.txt", buffer, sizeof(buffer));
+	check("read file", len == 5 && memcmp(buffer, "hello", 5) == 0);
+
+	// a reader keeps seeing the old contents until the writer closes
+	void* reader = vfs.open(&vfs, "/etc/config/a.txt", LFTPD_VFS_READ);
+	void* writer = vfs.open(&vfs, "/etc/config/a.txt", LFTPD_VFS_WRITE);
+	check("write", vfs.write(&vfs, writer, "goodbye", 7) == 7);
+	check("stat during write", vfs.stat(&vfs, "/etc/config/a.txt", &st) == 0 && st.st_size == 5);
+	vfs.close(&vfs, writer);
+	check("read snapshot", vfs.read(&vfs, reader, buffer, sizeof(buffer)) == 5);
+	vfs.close(&vfs, reader);
+	len = read_all(&vfs, "/etc/config/a.txt", buffer, sizeof(buffer));
+	check("read after write", len == 7 && memcmp(buffer, "goodbye", 7) == 0);
+
+	check("write into missing directory", vfs.open(&vfs, "/nope/b.txt", LFTPD_VFS_WRITE) == NULL);
+	check("mkdir", vfs.mkdir(&vfs, "/data") == 0);
+	check("mkdir existing", vfs.mkdir(&vfs, "/data") != 0);
+	check("utime", vfs.utime(&vfs, "/etc/config/a.txt", 1000000000) == 0);
+	check("stat after utime", vfs.stat(&vfs, "/etc/config/a.txt", &st) == 0 && st.st_mtime == 1000000000);
+	check("utime missing", vfs.utime(&vfs, "/etc/missing", 0) != 0);
+	check("rename", vfs.rename(&vfs, "/etc/config/a.txt", "/data/b.txt") == 0);
+	check("rename source gone", vfs.stat(&vfs, "/etc/config/a.txt", &st) != 0);
+	check("rename directory into itself", vfs.rename(&vfs, "/etc", "/etc/config/etc") != 0);
+	check("readdir", count_entries(&vfs, "/") == 2 && count_entries(&vfs, "/data") == 1);
+	check("readdir file", count_entries(&vfs, "/data/b.txt") == -1);
+	check("unlink non empty directory", vfs.unlink(&vfs, "/data") != 0);
+	check("unlink file", vfs.unlink(&vfs, "/data/b.txt") == 0);
+	check("unlink directory", vfs.unlink(&vfs, "/data") == 0);
+	check("readdir after unlink", count_entries(&vfs, "/") == 1);
+
+	lftpd_vfs_mem_destroy(&vfs);
+}